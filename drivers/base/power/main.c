@@ -28,6 +28,7 @@
 #include <linux/async.h>
 #include <linux/suspend.h>
 #include <linux/timer.h>
+#include <trace/events/power.h>
 
 #include "../base.h"
 #include "power.h"
@@ -163,28 +164,25 @@ void device_pm_move_last(struct device *dev)
 
 static ktime_t initcall_debug_start(struct device *dev)
 {
-	ktime_t calltime = ktime_set(0, 0);
-
-	if (initcall_debug) {
+	if (initcall_debug)
 		pr_info("calling  %s+ @ %i\n",
 				dev_name(dev), task_pid_nr(current));
-		calltime = ktime_get();
-	}
 
-	return calltime;
+	return ktime_get();
 }
 
-static void initcall_debug_report(struct device *dev, ktime_t calltime,
-				  int error)
+static void initcall_debug_report(struct device *dev, pm_message_t state,
+				  ktime_t calltime, int error)
 {
-	ktime_t delta, rettime;
+	ktime_t delta;
+
+	delta = ktime_sub(ktime_get(), calltime);
+	trace_device_pm_callback(dev_name(dev), state.event, 0,
+				 ktime_to_ns(delta), error);
 
-	if (initcall_debug) {
-		rettime = ktime_get();
-		delta = ktime_sub(rettime, calltime);
+	if (initcall_debug)
 		pr_info("call %s+ returned %d after %Ld usecs\n", dev_name(dev),
 			error, (unsigned long long)ktime_to_ns(delta) >> 10);
-	}
 }
 
 /**
@@ -274,7 +272,7 @@ static int pm_op(struct device *dev,
 		error = -EINVAL;
 	}
 
-	initcall_debug_report(dev, calltime, error);
+	initcall_debug_report(dev, state, calltime, error);
 
 	return error;
 }
@@ -293,14 +291,13 @@ static int pm_noirq_op(struct device *dev,
 			pm_message_t state)
 {
 	int error = 0;
-	ktime_t calltime = ktime_set(0, 0), delta, rettime;
+	ktime_t calltime, delta;
 
-	if (initcall_debug) {
+	if (initcall_debug)
 		pr_info("calling  %s+ @ %i, parent: %s\n",
 				dev_name(dev), task_pid_nr(current),
 				dev->parent ? dev_name(dev->parent) : "none");
-		calltime = ktime_get();
-	}
+	calltime = ktime_get();
 
 	switch (state.event) {
 #ifdef CONFIG_SUSPEND
@@ -349,13 +346,14 @@ static int pm_noirq_op(struct device *dev,
 		error = -EINVAL;
 	}
 
-	if (initcall_debug) {
-		rettime = ktime_get();
-		delta = ktime_sub(rettime, calltime);
+	delta = ktime_sub(ktime_get(), calltime);
+	trace_device_pm_callback(dev_name(dev), state.event, 1,
+				 ktime_to_ns(delta), error);
+
+	if (initcall_debug)
 		printk("initcall %s_i+ returned %d after %Ld usecs\n",
 			dev_name(dev), error,
 			(unsigned long long)ktime_to_ns(delta) >> 10);
-	}
 
 	return error;
 }
@@ -486,9 +484,11 @@ EXPORT_SYMBOL_GPL(dpm_resume_noirq);
 /**
  * legacy_resume - Execute a legacy (bus or class) resume callback for device.
  * @dev: Device to resume.
+ * @state: PM transition of the system being carried out.
  * @cb: Resume callback to execute.
  */
-static int legacy_resume(struct device *dev, int (*cb)(struct device *dev))
+static int legacy_resume(struct device *dev, pm_message_t state,
+			 int (*cb)(struct device *dev))
 {
 	int error;
 	ktime_t calltime;
@@ -498,7 +498,7 @@ static int legacy_resume(struct device *dev, int (*cb)(struct device *dev))
 	error = cb(dev);
 	suspend_report_result(cb, error);
 
-	initcall_debug_report(dev, calltime, error);
+	initcall_debug_report(dev, state, calltime, error);
 
 	return error;
 }
@@ -551,7 +551,7 @@ static int device_resume(struct device *dev, pm_message_t state, bool async)
 			goto End;
 		} else if (dev->class->resume) {
 			pm_dev_dbg(dev, state, "legacy class ");
-			error = legacy_resume(dev, dev->class->resume);
+			error = legacy_resume(dev, state, dev->class->resume);
 			goto End;
 		}
 	}
@@ -562,7 +562,7 @@ static int device_resume(struct device *dev, pm_message_t state, bool async)
 			error = pm_op(dev, dev->bus->pm, state);
 		} else if (dev->bus->resume) {
 			pm_dev_dbg(dev, state, "legacy ");
-			error = legacy_resume(dev, dev->bus->resume);
+			error = legacy_resume(dev, state, dev->bus->resume);
 		}
 	}
 
@@ -866,7 +866,7 @@ static int legacy_suspend(struct device *dev, pm_message_t state,
 	error = cb(dev, state);
 	suspend_report_result(cb, error);
 
-	initcall_debug_report(dev, calltime, error);
+	initcall_debug_report(dev, state, calltime, error);
 
 	return error;
 }
@@ -26,6 +26,8 @@
 #include <linux/workqueue.h>
 #include <linux/kthread.h>
 #include <linux/mutex.h>
+#include <linux/input.h>
+#include <linux/slab.h>
 
 #include <asm/cputime.h>
 
@@ -45,6 +47,7 @@ struct cpufreq_interactive_cpuinfo {
 	struct cpufreq_policy *policy;
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
+	u64 hispeed_validate_time;
 	int governor_enabled;
 };
 
@@ -91,6 +94,37 @@ static unsigned long min_sample_time;
 #define DEFAULT_TIMER_RATE 20000;
 static unsigned long timer_rate;
 
+/*
+ * Frequency to stop at when ramping up from below; if 0 - no stop is made
+ */
+static unsigned long hispeed_freq;
+
+/*
+ * The time to spend at or above hispeed_freq before each further raise.
+ */
+#define DEFAULT_ABOVE_HISPEED_DELAY 20000
+static unsigned long above_hispeed_delay;
+
+/*
+ * Target load per frequency range, as "load freq:load freq:load ...".
+ * A load applies from the frequency before it up to the one after it.
+ * If not set, sustain_load is used.
+ */
+static DEFINE_SPINLOCK(target_loads_lock);
+static unsigned int *target_loads;
+static int ntarget_loads;
+
+/*
+ * Frequency to ramp to on input events, and for how long (in uS) to stay
+ * there at least.  If 0 - input events are ignored.
+ */
+static unsigned long input_boost_freq;
+#define DEFAULT_INPUT_BOOST_DURATION 80000
+static unsigned long input_boost_duration;
+static unsigned long input_boost_until;
+/* Set from the input handler, applied by up_task; under up_cpumask_lock */
+static int input_boost_pending;
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -104,10 +138,29 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+/* Returns the target load at freq, or 0 if target_loads is not set. */
+static unsigned int freq_to_targetload(unsigned int freq)
+{
+	int i;
+	unsigned int ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	if (ntarget_loads) {
+		for (i = 0; i < ntarget_loads - 1 &&
+			     freq >= target_loads[i + 1]; i += 2)
+			;
+		ret = target_loads[i];
+	}
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	return ret;
+}
+
 static unsigned int cpufreq_interactive_get_target(
 	int cpu_load, int load_since_change, struct cpufreq_policy *policy)
 {
 	unsigned int target_freq;
+	unsigned int target_load;
 
 	/*
 	 * Choose greater of short-term load (since last idle timer
@@ -127,10 +180,13 @@ static unsigned int cpufreq_interactive_get_target(
 			target_freq = policy->cur + max_boost;
 	}
 	else {
-		if (!sustain_load)
+		target_load = freq_to_targetload(policy->cur);
+		if (target_load)
+			target_freq = policy->cur * cpu_load / target_load;
+		else if (!sustain_load)
 			return policy->max * cpu_load / 100;
-
-		target_freq = policy->cur * cpu_load / sustain_load;
+		else
+			target_freq = policy->cur * cpu_load / sustain_load;
 	}
 
 	target_freq = min(target_freq, policy->max);
@@ -236,6 +292,20 @@ static void cpufreq_interactive_timer(unsigned long data)
 	new_freq = cpufreq_interactive_get_target(cpu_load, load_since_change,
 						  pcpu->policy);
 
+	/*
+	 * Ramp up through hispeed_freq: stop there when coming from below,
+	 * and only go higher once we have been there for above_hispeed_delay.
+	 */
+	if (hispeed_freq && new_freq > hispeed_freq &&
+	    new_freq > pcpu->target_freq) {
+		if (pcpu->target_freq < hispeed_freq)
+			new_freq = hispeed_freq;
+		else if (cputime64_sub(pcpu->timer_run_time,
+				       pcpu->hispeed_validate_time)
+			 < above_hispeed_delay)
+			goto rearm;
+	}
+
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
 					   new_freq, CPUFREQ_RELATION_H,
 					   &index)) {
@@ -257,6 +327,11 @@ static void cpufreq_interactive_timer(unsigned long data)
 		if (cputime64_sub(pcpu->timer_run_time, pcpu->freq_change_time)
 		    < min_sample_time)
 			goto rearm;
+
+		/* Nor below the input boost frequency while it lasts. */
+		if (new_freq < input_boost_freq &&
+		    time_before(jiffies, input_boost_until))
+			goto rearm;
 	}
 
 	if (new_freq < pcpu->target_freq) {
@@ -267,6 +342,8 @@ static void cpufreq_interactive_timer(unsigned long data)
 		queue_work(down_wq, &freq_scale_down_work);
 	} else {
 		pcpu->target_freq = new_freq;
+		if (hispeed_freq && new_freq >= hispeed_freq)
+			pcpu->hispeed_validate_time = pcpu->timer_run_time;
 		spin_lock_irqsave(&up_cpumask_lock, flags);
 		cpumask_set_cpu(data, &up_cpumask);
 		spin_unlock_irqrestore(&up_cpumask_lock, flags);
@@ -399,18 +476,82 @@ static void cpufreq_interactive_idle_end(void)
 
 }
 
+/*
+ * Runs on a boosted CPU that had no timer armed.  An idle CPU at min speed
+ * has none, and would hold the boost, and through the shared clock every
+ * other CPU, until it next leaves idle.  Arm the timer from the CPU itself,
+ * as its idle hooks do, so it re-evaluates once the boost is over.
+ */
+static void cpufreq_interactive_boost_rearm(void *data)
+{
+	unsigned int cpu = smp_processor_id();
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+
+	smp_rmb();
+	if (!pcpu->governor_enabled || timer_pending(&pcpu->cpu_timer))
+		return;
+
+	pcpu->time_in_idle = get_cpu_idle_time_us(cpu, &pcpu->idle_exit_time);
+	pcpu->time_in_iowait = get_cpu_iowait_time(cpu, NULL);
+	pcpu->timer_idlecancel = 0;
+	mod_timer(&pcpu->cpu_timer, jiffies + usecs_to_jiffies(timer_rate));
+}
+
+/*
+ * Raise every CPU that is below input_boost_freq to it right away instead
+ * of waiting for the next timer to see the load, adding it to mask for
+ * up_task to set the new speed.  The timer keeps it from scaling back down
+ * below it until input_boost_until.
+ */
+static void cpufreq_interactive_input_boost(cpumask_t *mask)
+{
+	unsigned int cpu;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+
+	for_each_online_cpu(cpu) {
+		unsigned int index;
+
+		pcpu = &per_cpu(cpuinfo, cpu);
+		smp_rmb();
+
+		if (!pcpu->governor_enabled)
+			continue;
+
+		if (cpufreq_frequency_table_target(pcpu->policy,
+						   pcpu->freq_table,
+						   input_boost_freq,
+						   CPUFREQ_RELATION_H, &index))
+			continue;
+		if (pcpu->target_freq >= pcpu->freq_table[index].frequency)
+			continue;
+
+		pcpu->target_freq = pcpu->freq_table[index].frequency;
+		if (hispeed_freq && pcpu->target_freq >= hispeed_freq)
+			pcpu->hispeed_validate_time =
+				ktime_to_us(ktime_get());
+
+		if (!timer_pending(&pcpu->cpu_timer))
+			smp_call_function_single(cpu,
+					cpufreq_interactive_boost_rearm,
+					NULL, 0);
+
+		cpumask_set_cpu(cpu, mask);
+	}
+}
+
 static int cpufreq_interactive_up_task(void *data)
 {
 	unsigned int cpu;
 	cpumask_t tmp_mask;
 	unsigned long flags;
 	struct cpufreq_interactive_cpuinfo *pcpu;
+	int boost;
 
 	while (1) {
 		set_current_state(TASK_INTERRUPTIBLE);
 		spin_lock_irqsave(&up_cpumask_lock, flags);
 
-		if (cpumask_empty(&up_cpumask)) {
+		if (cpumask_empty(&up_cpumask) && !input_boost_pending) {
 			spin_unlock_irqrestore(&up_cpumask_lock, flags);
 			schedule();
 
@@ -423,8 +564,13 @@ static int cpufreq_interactive_up_task(void *data)
 		set_current_state(TASK_RUNNING);
 		tmp_mask = up_cpumask;
 		cpumask_clear(&up_cpumask);
+		boost = input_boost_pending;
+		input_boost_pending = 0;
 		spin_unlock_irqrestore(&up_cpumask_lock, flags);
 
+		if (boost && input_boost_freq)
+			cpufreq_interactive_input_boost(&tmp_mask);
+
 		for_each_cpu(cpu, &tmp_mask) {
 			unsigned int j;
 			unsigned int max_freq = 0;
@@ -505,6 +651,106 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 	}
 }
 
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+					    unsigned int type,
+					    unsigned int code, int value)
+{
+	unsigned long boost_jiffies = usecs_to_jiffies(input_boost_duration);
+	unsigned long flags;
+
+	if (type == EV_SYN || !input_boost_freq)
+		return;
+
+	/*
+	 * A swipe reports every coordinate, hundreds of events a second.
+	 * Only renew the boost once half of it has run out.
+	 */
+	if (time_before(jiffies + boost_jiffies / 2, input_boost_until))
+		return;
+
+	input_boost_until = jiffies + boost_jiffies;
+
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+	input_boost_pending = 1;
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+	wake_up_process(up_task);
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+					     struct input_dev *dev,
+					     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_input_register_handle;
+
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_input_open_device;
+
+	return 0;
+
+err_input_open_device:
+	input_unregister_handle(handle);
+err_input_register_handle:
+	kfree(handle);
+	return ret;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	/* multi-touch touchscreens */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	},
+	/* single-touch touchscreens and touchpads */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	/* keyboards, but not power, volume or headset buttons */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(KEY_Q)] = BIT_MASK(KEY_Q) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event = cpufreq_interactive_input_event,
+	.connect = cpufreq_interactive_input_connect,
+	.disconnect = cpufreq_interactive_input_disconnect,
+	.name = "cpufreq_interactive",
+	.id_table = cpufreq_interactive_ids,
+};
+
 static ssize_t show_go_maxspeed_load(struct kobject *kobj,
 				     struct attribute *attr, char *buf)
 {
@@ -655,6 +901,177 @@ static ssize_t store_timer_rate(struct kobject *kobj,
 static struct global_attr timer_rate_attr = __ATTR(timer_rate, 0644,
 		show_timer_rate, store_timer_rate);
 
+static ssize_t show_hispeed_freq(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", hispeed_freq);
+}
+
+static ssize_t store_hispeed_freq(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	hispeed_freq = val;
+	return count;
+}
+
+static struct global_attr hispeed_freq_attr = __ATTR(hispeed_freq, 0644,
+		show_hispeed_freq, store_hispeed_freq);
+
+static ssize_t show_above_hispeed_delay(struct kobject *kobj,
+					struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", above_hispeed_delay);
+}
+
+static ssize_t store_above_hispeed_delay(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	above_hispeed_delay = val;
+	return count;
+}
+
+static struct global_attr above_hispeed_delay_attr =
+	__ATTR(above_hispeed_delay, 0644,
+		show_above_hispeed_delay, store_above_hispeed_delay);
+
+static ssize_t show_target_loads(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	int i;
+	ssize_t ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	for (i = 0; i < ntarget_loads; i++)
+		ret += sprintf(buf + ret, "%u%s", target_loads[i],
+			       i & 0x1 ? ":" : " ");
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+
+	if (!ret)
+		return sprintf(buf, "0\n");
+	buf[ret - 1] = '\n';
+	return ret;
+}
+
+/*
+ * Parses "load freq:load freq:load ..." (an odd number of values separated
+ * by spaces or colons).  Writing a single 0 goes back to sustain_load.
+ */
+static ssize_t store_target_loads(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	const char *cp;
+	unsigned int *new_target_loads = NULL;
+	unsigned int *old_target_loads;
+	int ntokens = 1;
+	int i;
+	unsigned long flags;
+
+	for (cp = buf; (cp = strpbrk(cp + 1, " :")); )
+		ntokens++;
+	if (!(ntokens & 0x1))
+		return -EINVAL;
+
+	new_target_loads = kmalloc(ntokens * sizeof(unsigned int), GFP_KERNEL);
+	if (!new_target_loads)
+		return -ENOMEM;
+
+	for (cp = buf, i = 0; i < ntokens; i++) {
+		if (sscanf(cp, "%u", &new_target_loads[i]) != 1)
+			goto err_inval;
+		/* loads are divisors and the frequencies must ascend */
+		if (!(i & 0x1) && !new_target_loads[i] && ntokens > 1)
+			goto err_inval;
+		if ((i & 0x1) && i > 1 &&
+		    new_target_loads[i] <= new_target_loads[i - 2])
+			goto err_inval;
+		cp = strpbrk(cp, " :");
+		if (!cp)
+			break;
+		cp++;
+	}
+	if (i != ntokens - 1)
+		goto err_inval;
+
+	if (ntokens == 1 && !new_target_loads[0]) {
+		kfree(new_target_loads);
+		new_target_loads = NULL;
+		ntokens = 0;
+	}
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	old_target_loads = target_loads;
+	target_loads = new_target_loads;
+	ntarget_loads = ntokens;
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	kfree(old_target_loads);
+	return count;
+
+err_inval:
+	kfree(new_target_loads);
+	return -EINVAL;
+}
+
+static struct global_attr target_loads_attr = __ATTR(target_loads, 0644,
+		show_target_loads, store_target_loads);
+
+static ssize_t show_input_boost_freq(struct kobject *kobj,
+				     struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_freq);
+}
+
+static ssize_t store_input_boost_freq(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	input_boost_freq = val;
+	return count;
+}
+
+static struct global_attr input_boost_freq_attr = __ATTR(input_boost_freq,
+		0644, show_input_boost_freq, store_input_boost_freq);
+
+static ssize_t show_input_boost_duration(struct kobject *kobj,
+					 struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_duration);
+}
+
+static ssize_t store_input_boost_duration(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	input_boost_duration = val;
+	return count;
+}
+
+static struct global_attr input_boost_duration_attr =
+	__ATTR(input_boost_duration, 0644,
+		show_input_boost_duration, store_input_boost_duration);
+
 static struct attribute *interactive_attributes[] = {
 	&go_maxspeed_load_attr.attr,
 	&boost_factor_attr.attr,
@@ -663,6 +1080,11 @@ static struct attribute *interactive_attributes[] = {
 	&sustain_load_attr.attr,
 	&min_sample_time_attr.attr,
 	&timer_rate_attr.attr,
+	&hispeed_freq_attr.attr,
+	&above_hispeed_delay_attr.attr,
+	&target_loads_attr.attr,
+	&input_boost_freq_attr.attr,
+	&input_boost_duration_attr.attr,
 	NULL,
 };
 
@@ -789,6 +1211,9 @@ static int __init cpufreq_interactive_init(void)
 	go_maxspeed_load = DEFAULT_GO_MAXSPEED_LOAD;
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
 	timer_rate = DEFAULT_TIMER_RATE;
+	above_hispeed_delay = DEFAULT_ABOVE_HISPEED_DELAY;
+	input_boost_duration = DEFAULT_INPUT_BOOST_DURATION;
+	input_boost_until = jiffies;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
@@ -822,6 +1247,9 @@ static int __init cpufreq_interactive_init(void)
 
 	idle_notifier_register(&cpufreq_interactive_idle_nb);
 
+	if (input_register_handler(&cpufreq_interactive_input_handler))
+		pr_warn("cpufreq_interactive: no input boost\n");
+
 	return cpufreq_register_governor(&cpufreq_gov_interactive);
 
 err_freeuptask:
@@ -838,6 +1266,7 @@ module_init(cpufreq_interactive_init);
 static void __exit cpufreq_interactive_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_interactive);
+	input_unregister_handler(&cpufreq_interactive_input_handler);
 	kthread_stop(up_task);
 	put_task_struct(up_task);
 	destroy_workqueue(down_wq);
@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,29 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+/*
+ * A buffer object describes a block of sender memory that travels with a
+ * BC_TRANSACTION_SG or BC_REPLY_SG without being marshalled into the flat
+ * data.  The driver copies 'length' bytes at 'buffer' straight into the
+ * receiver's transaction buffer, behind the offsets, and rewrites 'buffer'
+ * to the receiver's address of the copy.  If BINDER_BUFFER_FLAG_HAS_PARENT
+ * is set, 'parent' is the index in the offsets array of an earlier buffer
+ * object, and the pointer stored 'parent_offset' bytes into that buffer is
+ * rewritten to the new address as well.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +171,15 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * A transaction that carries buffer objects; 'buffers_size' is the sum of
+ * their lengths, each rounded up to a multiple of sizeof(void *).
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	size_t		buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +357,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, whose offsets may
+	 * name buffer objects.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -25,38 +25,62 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/* reservations that may be in flight at once, at most BITS_PER_LONG */
+#define LOGGER_MAX_WRITERS	16
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets and the readers list are
+ * protected by the spinlock 'lock'; the buffer contents are not.
+ *
+ * Writers only hold the lock long enough to reserve space for their entry
+ * (advancing 'reserve' and fixing up lapped readers) and copy the entry in
+ * without it. Each reservation takes a slot in 'slot_end', in reservation
+ * order; 'w_off', the offset readers stop at, is advanced over the run of
+ * finished reservations at the front, so readers never see a partially
+ * written entry and finished entries become visible in order. 'w_off' is
+ * also the start of the oldest unfinished reservation, and new reservations
+ * wait on 'writer_wq' rather than wrap onto it. Readers copy out without the
+ * lock too and detect being lapped in the meantime by fix_up_readers()
+ * having bumped their 'moved' count.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* lock protecting offsets */
+	size_t			w_off;	/* committed write head offset */
+	size_t			reserve; /* next offset handed to a writer */
+	wait_queue_head_t	writer_wq; /* writers waiting for room */
+	size_t			slot_end[LOGGER_MAX_WRITERS]; /* reservation ends */
+	unsigned long		slot_done; /* bitmap of finished slots */
+	unsigned int		first_slot; /* oldest unfinished reservation */
+	unsigned int		writers; /* reservations not yet published */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *header; /* mmap()ed copy of w_off */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned long		moved;	/* times r_off was moved for us */
+	int			batch;	/* read() returns as many entries as fit */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -89,7 +113,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,25 +132,24 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes from 'log' starting at
+ * 'off' into the user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Called without log->lock; the caller has to check afterwards that the
+ * bytes were not overwritten while they were being copied.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
 
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
+	 * the read offset up to 'count' bytes or to the end of the log,
+	 * whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,11 +160,31 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * get_batch_len - returns the length of the run of whole entries starting at
+ * 'off' that fits in 'count' bytes, stopping at the write head.
+ *
+ * Caller must hold log->lock.
+ */
+static size_t get_batch_len(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len = 0;
+
+	while (off != log->w_off) {
+		size_t nr = get_entry_len(log, off);
+
+		if (len + nr > count)
+			break;
+		len += nr;
+		off = logger_offset(off + nr);
+	}
+
+	return len;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -149,7 +192,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or as many whole entries as
+ * 	  fit in the buffer after LOGGER_SET_READ_BATCH
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -159,6 +203,8 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	size_t r_off;
+	unsigned long moved;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -166,9 +212,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,26 +235,44 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
+	r_off = reader->r_off;
+	moved = reader->moved;
+	ret = get_entry_len(log, r_off);
 	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+		spin_unlock(&log->lock);
+		return -EINVAL;
 	}
+	if (reader->batch)
+		ret = get_batch_len(log, r_off, count);
+	spin_unlock(&log->lock);
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/* get exactly one entry, or a run of whole entries, from the log */
+	ret = do_read_log_to_user(log, r_off, buf, ret);
+	if (ret < 0)
+		return ret;
 
-out:
-	mutex_unlock(&log->mutex);
+	/*
+	 * If a writer lapped us while we were copying, fix_up_readers() has
+	 * moved our read offset and what we copied may be garbage: try again
+	 * from wherever we were pulled forward to. The offset itself can't
+	 * tell, as it may have been pulled a whole lap back to where it was.
+	 */
+	spin_lock(&log->lock);
+	if (unlikely(reader->moved != moved)) {
+		spin_unlock(&log->lock);
+		goto start;
+	}
+	reader->r_off = logger_offset(r_off + ret);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -217,14 +281,19 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
 	size_t count = 0;
 
 	do {
-		size_t nr = get_entry_len(log, off);
+		size_t nr;
+
+		/* never walk into entries that are still being written */
+		if (off == log->w_off)
+			break;
+		nr = get_entry_len(log, off);
 		off = logger_offset(off + nr);
 		count += nr;
 	} while (count < len);
@@ -253,13 +322,13 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * entry after the new reservation head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
-	size_t old = log->w_off;
+	size_t old = log->reserve;
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
@@ -267,55 +336,173 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 		log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (clock_interval(old, new, reader->r_off)) {
 			reader->r_off = get_next_entry(log, reader->r_off, len);
+			reader->moved++;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at '*off' and
+ * advances '*off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have reserved the space with log_reserve().
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t *off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - *off);
+	memcpy(log->buffer + *off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
 
-	log->w_off = logger_offset(log->w_off + count);
+	*off = logger_offset(*off + count);
 
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the log 'log' at '*off' and advances '*off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have reserved the space with log_reserve().
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t *off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - *off);
+	if (len && copy_from_user(log->buffer + *off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+	*off = logger_offset(*off + count);
 
 	return count;
 }
 
+/*
+ * do_clear_log - zeroes 'count' bytes of 'log' at 'off'
+ *
+ * Used to blank the rest of a reserved entry whose payload could not be
+ * copied in; the space can not be handed back once later writers have
+ * reserved past it.
+ */
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len;
+
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
+
+	if (count != len)
+		memset(log->buffer, 0, count - len);
+}
+
+/*
+ * log_has_room - can 'len' more bytes be reserved right now?
+ *
+ * There has to be a free slot, and the new reservation must not reach the
+ * oldest one still being written, which starts at w_off.
+ *
+ * Caller must hold log->lock.
+ */
+static inline int log_has_room(struct logger_log *log, size_t len)
+{
+	if (!log->writers)
+		return 1;
+	return log->writers < LOGGER_MAX_WRITERS &&
+		logger_offset(log->reserve - log->w_off) + len < log->size;
+}
+
+static int log_has_room_unlocked(struct logger_log *log, size_t len)
+{
+	int ret;
+
+	spin_lock(&log->lock);
+	ret = log_has_room(log, len);
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+/*
+ * log_reserve - reserve 'len' bytes for a new entry and return its offset
+ *
+ * Fix up any readers, pulling them forward to the first readable entry after
+ * (what will be) the new reservation head. We do this now because once we
+ * drop the lock the space will be overwritten. The slot to hand back to
+ * log_commit() is returned in '*slot'.
+ */
+static size_t log_reserve(struct logger_log *log, size_t len,
+			  unsigned int *slot)
+{
+	size_t off;
+
+	spin_lock(&log->lock);
+	while (unlikely(!log_has_room(log, len))) {
+		spin_unlock(&log->lock);
+		wait_event(log->writer_wq, log_has_room_unlocked(log, len));
+		spin_lock(&log->lock);
+	}
+	fix_up_readers(log, len);
+	off = log->reserve;
+	log->reserve = logger_offset(off + len);
+	*slot = (log->first_slot + log->writers) % LOGGER_MAX_WRITERS;
+	log->slot_end[*slot] = log->reserve;
+	log->writers++;
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * log_commit - finish a write started with log_reserve()
+ *
+ * Entries become visible to readers only once every writer that reserved
+ * space before us is done as well, so that readers never run into an entry
+ * that is still being copied in. Whatever run of finished reservations is
+ * at the front is published right away.
+ */
+static void log_commit(struct logger_log *log, unsigned int slot)
+{
+	size_t w_off;
+	int published;
+
+	spin_lock(&log->lock);
+	w_off = log->w_off;
+	__set_bit(slot, &log->slot_done);
+	while (log->writers && test_bit(log->first_slot, &log->slot_done)) {
+		__clear_bit(log->first_slot, &log->slot_done);
+		w_off = log->slot_end[log->first_slot];
+		log->first_slot = (log->first_slot + 1) % LOGGER_MAX_WRITERS;
+		log->writers--;
+	}
+	published = (w_off != log->w_off);
+	if (published) {
+		if (log->header) {
+			log->header->w_total += logger_offset(w_off -
+							      log->w_off);
+			smp_wmb();
+			log->header->w_off = w_off;
+		}
+		log->w_off = w_off;
+	}
+	spin_unlock(&log->lock);
+
+	/* published reservations free up their slots and space */
+	if (published)
+		wake_up(&log->writer_wq);
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -325,9 +512,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t off;
+	unsigned int slot;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -342,17 +530,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	off = log_reserve(log, sizeof(struct logger_entry) + header.len, &slot);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, &off, &header, sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,10 +542,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, &off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			do_clear_log(log, off, header.len - ret);
+			log_commit(log, slot);
 			return nr;
 		}
 
@@ -373,7 +553,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	log_commit(log, slot);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
@@ -409,12 +589,14 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->batch = 0;
+		reader->moved = 0;
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -432,7 +614,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
 		kfree(reader);
 	}
 
@@ -462,21 +648,56 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps a read-only page holding a struct logger_mmap_header followed by the
+ * ring buffer itself, so readers can follow the log without a system call
+ * per batch. Entries between a reader's offset and header->w_off are whole,
+ * but may be overwritten at any time; w_total lets the reader tell.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (!log->header)
+		return -ENODEV;
+	if (vma->vm_pgoff || size != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->header) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       log->size, vma->vm_page_prot);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -509,14 +730,25 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
+		list_for_each_entry(reader, &log->readers, list) {
 			reader->r_off = log->w_off;
+			reader->moved++;
+		}
 		log->head = log->w_off;
 		ret = 0;
 		break;
+	case LOGGER_SET_READ_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -526,6 +758,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -534,11 +767,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, at least PAGE_SIZE, greater than
+ * LOGGER_ENTRY_MAX_LEN, and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * The buffer is page aligned so that it can be mmap()ed.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -549,8 +783,11 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.reserve = 0, \
+	.writer_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .writer_wq), \
+	.writers = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -577,6 +814,11 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/* without the header page the log simply can't be mmap()ed */
+	log->header = (struct logger_mmap_header *) get_zeroed_page(GFP_KERNEL);
+	if (log->header)
+		log->header->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
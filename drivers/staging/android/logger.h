@@ -35,6 +35,20 @@ struct logger_entry {
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
 #define LOGGER_LOG_MAIN		"log_main"	/* everything else */
 
+/*
+ * struct logger_mmap_header - first page of a log mapped with mmap()
+ *
+ * The log buffer follows at an offset of one page. w_total counts the bytes
+ * ever committed to the log (modulo 2^32). Writers copy in ahead of w_off, so
+ * a reader should re-check w_total after copying entries out and discard them
+ * if it has advanced to within a few LOGGER_ENTRY_MAX_LEN of a full lap.
+ */
+struct logger_mmap_header {
+	__u32		w_off;	/* write head offset, entries end here */
+	__u32		w_total; /* bytes committed since the log was created */
+	__u32		size;	/* size of the log buffer */
+};
+
 #define LOGGER_ENTRY_MAX_LEN		(4*1024)
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
@@ -45,5 +59,6 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_BATCH		_IO(__LOGGERIO, 5) /* multi-entry read */
 
 #endif /* _LINUX_LOGGER_H */
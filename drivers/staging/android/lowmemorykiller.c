@@ -16,6 +16,11 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Reclaim pressure is also reported to user-space through /dev/lowmem_pressure
+ * so caches can be trimmed before anything has to be killed. Write "low",
+ * "medium" or "critical" to pick the lowest level of interest (default low),
+ * then poll() for POLLIN; read() returns the level of the latest event.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +40,14 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/uaccess.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +68,23 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders bucketed by signal->oom_adj. Membership changes on
+ * fork/exit/exec happen with tasklist_lock write-locked; moves between
+ * buckets on oom_adj writes and the victim scan hold tasklist_lock for
+ * read and serialize on lowmem_adj_lock.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct list_head lowmem_adj_buckets[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static bool lowmem_adj_ready;
+
+static u64 lowmem_scan_count;
+static u64 lowmem_scan_last_ns;
+static u64 lowmem_scan_max_ns;
+static u64 lowmem_scan_total_ns;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,13 +109,75 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static struct list_head *lowmem_adj_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return &lowmem_adj_buckets[oom_adj - OOM_DISABLE];
+}
+
+void lowmem_adj_add(struct task_struct *p)
+{
+	if (!lowmem_adj_ready)
+		return;
+	spin_lock(&lowmem_adj_lock);
+	list_add_tail(&p->lowmem_adj_node,
+		      lowmem_adj_bucket(p->signal->oom_adj));
+	spin_unlock(&lowmem_adj_lock);
+}
+
+void lowmem_adj_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_adj_lock);
+	list_del_init(&p->lowmem_adj_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+void lowmem_adj_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_adj_lock);
+	if (!list_empty(&old->lowmem_adj_node))
+		list_replace_init(&old->lowmem_adj_node,
+				  &new->lowmem_adj_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+void lowmem_adj_update(struct task_struct *p)
+{
+	struct task_struct *leader;
+
+	read_lock(&tasklist_lock);
+	leader = p->group_leader;
+	spin_lock(&lowmem_adj_lock);
+	if (!list_empty(&leader->lowmem_adj_node))
+		list_move_tail(&leader->lowmem_adj_node,
+			       lowmem_adj_bucket(leader->signal->oom_adj));
+	spin_unlock(&lowmem_adj_lock);
+	read_unlock(&tasklist_lock);
+}
+
+static void lowmem_scan_account(ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	lowmem_scan_count++;
+	lowmem_scan_last_ns = ns;
+	lowmem_scan_total_ns += ns;
+	if (ns > lowmem_scan_max_ns)
+		lowmem_scan_max_ns = ns;
+}
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
+	ktime_t scan_start;
 	int rem = 0;
 	int tasksize;
 	int i;
+	int oom_adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
@@ -131,41 +223,41 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	}
 	selected_oom_adj = min_adj;
 
+	scan_start = ktime_get();
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+	spin_lock(&lowmem_adj_lock);
+	/*
+	 * Only the highest non-empty bucket at or above min_adj is searched
+	 * for the largest task; lower buckets are looked at only if every
+	 * task in the higher ones has already released its mm.
+	 */
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj && !selected;
+	     oom_adj--) {
+		list_for_each_entry(p, lowmem_adj_bucket(oom_adj),
+				    lowmem_adj_node) {
+			struct mm_struct *mm;
+
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			if (tasksize <= 0)
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			if (selected && tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+	spin_unlock(&lowmem_adj_lock);
+	lowmem_scan_account(scan_start);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -186,15 +278,209 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static const char * const lowmem_pressure_names[VMPRESSURE_NR_LEVELS] = {
+	[VMPRESSURE_LOW]	= "low",
+	[VMPRESSURE_MEDIUM]	= "medium",
+	[VMPRESSURE_CRITICAL]	= "critical",
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+/* Count and level of the latest event at or above each level */
+static unsigned long lowmem_pressure_seq[VMPRESSURE_NR_LEVELS];
+static int lowmem_pressure_last[VMPRESSURE_NR_LEVELS];
+
+struct lowmem_pressure_reader {
+	int level;		/* lowest level this reader wants to see */
+	unsigned long seq;	/* lowmem_pressure_seq[level] last consumed */
+};
+
+static int lowmem_pressure_notify(struct notifier_block *nb,
+				  unsigned long level, void *data)
+{
+	int i;
+
+	spin_lock(&lowmem_pressure_lock);
+	for (i = 0; i <= level; i++) {
+		lowmem_pressure_seq[i]++;
+		lowmem_pressure_last[i] = level;
+	}
+	spin_unlock(&lowmem_pressure_lock);
+	wake_up_interruptible(&lowmem_pressure_wait);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_pressure_nb = {
+	.notifier_call	= lowmem_pressure_notify,
+};
+
+static bool lowmem_pressure_pending(struct lowmem_pressure_reader *r)
+{
+	bool pending;
+
+	spin_lock(&lowmem_pressure_lock);
+	pending = lowmem_pressure_seq[r->level] != r->seq;
+	spin_unlock(&lowmem_pressure_lock);
+	return pending;
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	struct lowmem_pressure_reader *r;
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (ret)
+		return ret;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	r->level = VMPRESSURE_LOW;
+	spin_lock(&lowmem_pressure_lock);
+	r->seq = lowmem_pressure_seq[r->level];
+	spin_unlock(&lowmem_pressure_lock);
+	file->private_data = r;
+	return 0;
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	struct lowmem_pressure_reader *r = file->private_data;
+	char kbuf[16];
+	unsigned long seq;
+	int len;
+	int ret;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (!lowmem_pressure_pending(r))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(lowmem_pressure_wait,
+					       lowmem_pressure_pending(r));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&lowmem_pressure_lock);
+	seq = lowmem_pressure_seq[r->level];
+	len = scnprintf(kbuf, sizeof(kbuf), "%s\n",
+			lowmem_pressure_names[lowmem_pressure_last[r->level]]);
+	spin_unlock(&lowmem_pressure_lock);
+
+	/* leave the event pending unless it reaches userspace */
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, kbuf, len))
+		return -EFAULT;
+	r->seq = seq;
+	return len;
+}
+
+static ssize_t lowmem_pressure_write(struct file *file,
+				     const char __user *buf,
+				     size_t count, loff_t *pos)
+{
+	struct lowmem_pressure_reader *r = file->private_data;
+	char kbuf[16];
+	int level;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+
+	for (level = 0; level < VMPRESSURE_NR_LEVELS; level++)
+		if (!strcmp(strstrip(kbuf), lowmem_pressure_names[level]))
+			break;
+	if (level == VMPRESSURE_NR_LEVELS)
+		return -EINVAL;
+
+	spin_lock(&lowmem_pressure_lock);
+	r->level = level;
+	r->seq = lowmem_pressure_seq[level];
+	spin_unlock(&lowmem_pressure_lock);
+	return count;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	struct lowmem_pressure_reader *r = file->private_data;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if (lowmem_pressure_pending(r))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.release = lowmem_pressure_release,
+	.read = lowmem_pressure_read,
+	.write = lowmem_pressure_write,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
+static void __init lowmem_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("lowmemorykiller", NULL);
+	if (!dir)
+		return;
+	debugfs_create_u64("scan_count", S_IRUGO, dir, &lowmem_scan_count);
+	debugfs_create_u64("scan_last_ns", S_IRUGO, dir, &lowmem_scan_last_ns);
+	debugfs_create_u64("scan_max_ns", S_IRUGO, dir, &lowmem_scan_max_ns);
+	debugfs_create_u64("scan_total_ns", S_IRUGO, dir,
+			   &lowmem_scan_total_ns);
+}
+
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_buckets[i]);
+
+	/* Pick up the processes that were forked before we got here */
+	write_lock_irq(&tasklist_lock);
+	lowmem_adj_ready = true;
+	for_each_process(p)
+		lowmem_adj_add(p);
+	write_unlock_irq(&tasklist_lock);
+
+	lowmem_debugfs_init();
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+	if (misc_register(&lowmem_pressure_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "pressure device\n");
+	else
+		register_vmpressure_notifier(&lowmem_pressure_nb);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	unregister_vmpressure_notifier(&lowmem_pressure_nb);
+	misc_deregister(&lowmem_pressure_misc);
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
 }
@@ -26,12 +26,17 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
+#include <linux/hash.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -71,6 +76,29 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/*
+ * Decompresses the 'clen' byte object at 'cmem' into the page sized buffer
+ * 'mem' with this CPU's transform, accounting the time spent.
+ */
+static int zram_decompress(struct zram *zram, unsigned char *cmem,
+			   unsigned int clen, unsigned char *mem)
+{
+	int ret;
+	u64 start;
+	unsigned int dlen = PAGE_SIZE;
+	struct zram_workspace *ws;
+
+	ws = get_cpu_ptr(zram->workspace);
+	start = sched_clock();
+	ret = crypto_comp_decompress(ws->tfm, cmem, clen, mem, &dlen);
+	zram_stat64_add(zram, &zram->stats.decompress_time,
+			sched_clock() - start);
+	put_cpu_ptr(zram->workspace);
+	zram_stat64_inc(zram, &zram->stats.num_decompress);
+
+	return ret;
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -89,21 +117,199 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Checks whether the page consists of a single repeated word, returned
+ * through 'element'. Zero filled pages are the common case.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+static void fill_page_words(void *ptr, unsigned long element, size_t len)
+{
+	unsigned long *page = ptr;
+	size_t pos;
+
+	if (!element) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+/*
+ * Deduplication of identical compressed objects.
+ *
+ * Every object stored while dedup is enabled gets an entry hashed both by a
+ * checksum of its contents, to find duplicates on write, and by its handle,
+ * to drop references on free. Table slots holding the same data share one
+ * object. Objects whose entry couldn't be allocated are simply never
+ * shared, so a missing entry means the caller is the only owner.
+ */
+static struct hlist_head *zram_dedup_csum_bucket(struct zram *zram,
+						 u32 checksum)
+{
+	return &zram->dedup_hash[hash_32(checksum, ZRAM_DEDUP_HASH_BITS)];
+}
+
+static struct hlist_head *zram_dedup_handle_bucket(struct zram *zram,
+						   unsigned long handle)
+{
+	return &zram->dedup_hash[ZRAM_DEDUP_BUCKETS +
+				 hash_long(handle, ZRAM_DEDUP_HASH_BITS)];
+}
+
+/*
+ * Looks for an object holding the 'len' bytes at 'cmem' and takes a
+ * reference to it. Returns its handle, or 0 if there is none.
+ */
+static unsigned long zram_dedup_get(struct zram *zram, unsigned char *cmem,
+				    size_t len, u32 checksum)
+{
+	struct zram_dedup_entry *entry;
+	struct hlist_node *pos;
+	unsigned long handle = 0;
+	unsigned char *obj;
+	int match;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_csum_bucket(zram, checksum),
+			     csum_node) {
+		if (entry->checksum != checksum || entry->len != len)
+			continue;
+
+		obj = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		match = !memcmp(obj, cmem, len);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (match) {
+			entry->refcount++;
+			handle = entry->handle;
+			break;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	if (handle) {
+		zram_stat64_inc(zram, &zram->stats.dedup_hits);
+		zram_stat64_add(zram, &zram->stats.dedup_size, len);
+	}
+
+	return handle;
+}
+
+/* Makes a newly stored object available for sharing */
+static void zram_dedup_insert(struct zram *zram, unsigned long handle,
+			      size_t len, u32 checksum)
+{
+	struct zram_dedup_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOWAIT | __GFP_NOWARN);
+	if (!entry)
+		return;
+
+	entry->handle = handle;
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&entry->csum_node,
+		       zram_dedup_csum_bucket(zram, checksum));
+	hlist_add_head(&entry->handle_node,
+		       zram_dedup_handle_bucket(zram, handle));
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drops a reference to the object at 'handle'. Returns 1 if other table
+ * slots still use it, in which case it must not be freed.
+ */
+static int zram_dedup_put(struct zram *zram, unsigned long handle)
+{
+	struct zram_dedup_entry *entry;
+	struct hlist_node *pos;
+	int shared = 0;
+	size_t len = 0;
+
+	if (!zram->dedup_hash)
+		return 0;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_handle_bucket(zram, handle),
+			     handle_node) {
+		if (entry->handle != handle)
+			continue;
+
+		if (--entry->refcount) {
+			shared = 1;
+			len = entry->len;
+		} else {
+			hlist_del(&entry->csum_node);
+			hlist_del(&entry->handle_node);
+			kfree(entry);
+		}
+		break;
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	if (shared)
+		zram_stat64_sub(zram, &zram->stats.dedup_size, len);
+
+	return shared;
+}
+
+static int zram_dedup_init(struct zram *zram)
+{
+	int i;
+
+	if (!zram->dedup_enable)
+		return 0;
+
+	zram->dedup_hash = vmalloc(2 * ZRAM_DEDUP_BUCKETS *
+				   sizeof(*zram->dedup_hash));
+	if (!zram->dedup_hash)
+		return -ENOMEM;
+
+	for (i = 0; i < 2 * ZRAM_DEDUP_BUCKETS; i++)
+		INIT_HLIST_HEAD(&zram->dedup_hash[i]);
+
+	return 0;
+}
+
+static void zram_dedup_destroy(struct zram *zram)
+{
+	struct zram_dedup_entry *entry;
+	struct hlist_node *pos, *n;
+	int i;
+
+	if (!zram->dedup_hash)
+		return;
+
+	for (i = 0; i < ZRAM_DEDUP_BUCKETS; i++) {
+		hlist_for_each_entry_safe(entry, pos, n, &zram->dedup_hash[i],
+					  csum_node)
+			kfree(entry);
+	}
+
+	vfree(zram->dedup_hash);
+	zram->dedup_hash = NULL;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,15 +339,161 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Writeback of pages to the backing device.
+ *
+ * Slots written back have ZRAM_WB set and keep the number of their page
+ * sized block on the backing device in place of the handle. Block 0 is
+ * never used so that a zero handle still means the slot is empty.
+ */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk = 1;
+
+	do {
+		blk = find_next_zero_bit(zram->wb_bitmap, zram->wb_nr_blocks,
+					 blk);
+		if (blk >= zram->wb_nr_blocks)
+			return 0;
+	} while (test_and_set_bit(blk, zram->wb_bitmap));
+
+	return blk;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+	clear_bit(blk, zram->wb_bitmap);
+}
+
+static void zram_touch(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = jiffies;
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	if (err)
+		clear_bit(BIO_UPTODATE, &bio->bi_flags);
+	complete(bio->bi_private);
+}
+
+/* Synchronously reads or writes one block of the backing device */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long blk, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw == WRITE ? WRITE_SYNC : READ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	if (!ret)
+		zram_stat64_inc(zram, rw == WRITE ? &zram->stats.bd_writes :
+						    &zram->stats.bd_reads);
+	return ret;
+}
+
+struct zram_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_read_work_fn(struct work_struct *work)
+{
+	struct zram_read_work *rw;
+
+	rw = container_of(work, struct zram_read_work, work);
+	rw->ret = zram_bdev_rw(rw->zram, rw->page, rw->blk, READ);
+}
+
+/*
+ * Reads back the page written back from slot 'index' into a newly
+ * allocated page. Bios submitted from our make_request function are only
+ * queued until it returns, so the read is done from a worker.
+ */
+static struct page *zram_read_wb_page(struct zram *zram, u32 index)
+{
+	struct zram_read_work rw;
+
+	rw.page = alloc_page(GFP_NOIO);
+	if (!rw.page)
+		return NULL;
+
+	rw.zram = zram;
+	rw.blk = zram->table[index].handle;
+	INIT_WORK_ONSTACK(&rw.work, zram_read_work_fn);
+	queue_work(system_unbound_wq, &rw.work);
+	flush_work(&rw.work);
+	destroy_work_on_stack(&rw.work);
+
+	if (rw.ret) {
+		pr_err("Error reading back page %u from backing device: "
+		       "err=%d\n", index, rw.ret);
+		__free_page(rw.page);
+		return NULL;
+	}
+
+	return rw.page;
+}
+#else
+static inline void zram_free_block(struct zram *zram, unsigned long blk) { }
+static inline void zram_touch(struct zram *zram, u32 index) { }
+
+static inline struct page *zram_read_wb_page(struct zram *zram, u32 index)
+{
+	return NULL;
+}
+#endif
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+	u32 clen = zram->table[index].size;
+
+	/* A pending writeback of this slot must not complete */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, handle);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram->table[index].handle = 0;
+		return;
+	}
 
-	if (unlikely(!page)) {
+	/*
+	 * No memory is allocated for same filled pages, the table keeps the
+	 * repeated word in place of the handle.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].handle = 0;
+		return;
+	}
+
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -154,18 +506,14 @@ static void zram_free_page(struct zram *zram, size_t index)
 	}
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	if (!zram_dedup_put(zram, handle))
+		zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -173,17 +521,55 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
+}
+
+/*
+ * Frees the slots marked by zram_slot_free_notify() while the table was
+ * locked. Called with zram->lock held for writing.
+ */
+static void zram_free_pending(struct zram *zram)
+{
+	unsigned long index;
+
+	if (!atomic_read(&zram->nr_free_pending))
+		return;
+
+	for_each_set_bit(index, zram->free_pending,
+			 zram->disksize >> PAGE_SHIFT) {
+		if (!test_and_clear_bit(index, zram->free_pending))
+			continue;
+		atomic_dec(&zram->nr_free_pending);
+		zram_free_page(zram, index);
+	}
+}
+
+/*
+ * Locks the table for writing. Pending slot frees are done first, so that
+ * they cannot hit a slot once it has been written again.
+ */
+static void zram_write_lock(struct zram *zram)
+{
+	down_write(&zram->lock);
+	zram_free_pending(zram);
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void zram_free_work_fn(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, free_work);
+
+	zram_write_lock(zram);
+	up_write(&zram->lock);
+}
+
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	fill_page_words(user_mem + bvec->bv_offset, element, bvec->bv_len);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -196,7 +582,7 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
 	kunmap_atomic(cmem, KM_USER1);
@@ -205,6 +591,30 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	flush_dcache_page(page);
 }
 
+static int handle_wb_page(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset)
+{
+	struct page *page = bvec->bv_page, *wb_page;
+	unsigned char *user_mem, *wb_mem;
+
+	wb_page = zram_read_wb_page(zram, index);
+	if (!wb_page) {
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return -EIO;
+	}
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	wb_mem = kmap_atomic(wb_page, KM_USER1);
+	memcpy(user_mem + bvec->bv_offset, wb_mem + offset, bvec->bv_len);
+	kunmap_atomic(wb_mem, KM_USER1);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+	__free_page(wb_page);
+
+	return 0;
+}
+
 static inline int is_partial_io(struct bio_vec *bvec)
 {
 	return bvec->bv_len != PAGE_SIZE;
@@ -214,23 +624,29 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
 	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].handle);
 		return 0;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_WB))
+		return handle_wb_page(zram, bvec, index, offset);
+
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].handle)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
 		return 0;
 	}
 
@@ -252,14 +668,12 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+			     ZS_MM_RO);
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
+	ret = zram_decompress(zram, cmem, zram->table[index].size, uncmem);
+	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
@@ -267,11 +681,10 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		kfree(uncmem);
 	}
 
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -282,36 +695,53 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+static int zram_read_before_write(struct zram *zram, unsigned char *mem,
+				  u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
 	unsigned char *cmem;
 
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		fill_page_words(mem, zram->table[index].handle, PAGE_SIZE);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		struct page *wb_page = zram_read_wb_page(zram, index);
+
+		if (!wb_page) {
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+			return -EIO;
+		}
+		cmem = kmap_atomic(wb_page, KM_USER0);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER0);
+		__free_page(wb_page);
+		return 0;
+	}
+
 	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	    !zram->table[index].handle) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
-
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic((struct page *)zram->table[index].handle,
+				   KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
 		return 0;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+			     ZS_MM_RO);
+	ret = zram_decompress(zram, cmem, zram->table[index].size, mem);
+	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -320,18 +750,178 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/*
+ * Compresses 'mem' with this CPU's workspace and stores the result in a new
+ * object, which is returned through 'handle' together with its length and
+ * flags. The table is not touched.
+ *
+ * The workspace can't be held across a sleeping allocation, so the object is
+ * first allocated without blocking; failing that, it is allocated with
+ * reclaim allowed and the page is compressed again. 'page' is the source
+ * page for full page writes and is mapped here; for partial writes 'mem'
+ * points to the merged copy of the page and 'page' is NULL.
+ *
+ * Pages made of one repeated word aren't stored at all: 'handle' returns
+ * the word and 'flags' ZRAM_SAME (or ZRAM_ZERO for zero pages). With dedup
+ * enabled, 'handle' may refer to an existing object with the same data.
+ */
+static int zram_compress_page(struct zram *zram, struct page *page,
+			      unsigned char *mem, unsigned long *handle,
+			      size_t *clen, u8 *flags)
+{
+	int ret;
+	u64 start;
+	u32 checksum = 0;
+	unsigned int dlen;
+	unsigned long element;
+	size_t alloc_len = 0;
+	struct page *page_store;
+	struct zram_workspace *ws;
+	unsigned char *user_mem = NULL, *cmem;
+
+	*handle = 0;
+	*flags = 0;
+
+compress_again:
+	if (page)
+		mem = user_mem = kmap_atomic(page, KM_USER0);
+
+	if (page_same_filled(mem, &element)) {
+		if (user_mem)
+			kunmap_atomic(user_mem, KM_USER0);
+		if (*handle)
+			zs_free(zram->mem_pool, *handle);
+		*handle = element;
+		*clen = 0;
+		*flags = element ? BIT(ZRAM_SAME) : BIT(ZRAM_ZERO);
+		return 0;
+	}
+
+	ws = get_cpu_ptr(zram->workspace);
+	dlen = 2 * PAGE_SIZE;
+	start = sched_clock();
+	ret = crypto_comp_compress(ws->tfm, mem, PAGE_SIZE, ws->buffer, &dlen);
+	zram_stat64_add(zram, &zram->stats.compress_time,
+			sched_clock() - start);
+	zram_stat64_inc(zram, &zram->stats.num_compress);
+	*clen = dlen;
+	if (unlikely(ret)) {
+		put_cpu_ptr(zram->workspace);
+		if (user_mem)
+			kunmap_atomic(user_mem, KM_USER0);
+		pr_err("Compression failed! err=%d\n", ret);
+		goto fail;
+	}
+
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(*clen > max_zpage_size)) {
+		put_cpu_ptr(zram->workspace);
+		if (user_mem)
+			kunmap_atomic(user_mem, KM_USER0);
+		if (*handle)
+			zs_free(zram->mem_pool, *handle);
+		*handle = 0;
+
+		*clen = PAGE_SIZE;
+		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page_store)) {
+			pr_info("Error allocating memory for "
+				"incompressible page\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+
+		if (page)
+			mem = user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, mem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		if (user_mem)
+			kunmap_atomic(user_mem, KM_USER0);
+
+		*handle = (unsigned long)page_store;
+		*flags = BIT(ZRAM_UNCOMPRESSED);
+		return 0;
+	}
+
+	if (zram->dedup_hash) {
+		unsigned long dup;
+
+		checksum = jhash(ws->buffer, *clen, 0);
+		dup = zram_dedup_get(zram, ws->buffer, *clen, checksum);
+		if (dup) {
+			put_cpu_ptr(zram->workspace);
+			if (user_mem)
+				kunmap_atomic(user_mem, KM_USER0);
+			if (*handle)
+				zs_free(zram->mem_pool, *handle);
+			*handle = dup;
+			return 0;
+		}
+	}
+
+	/* An object left over from a previous pass may be too small now */
+	if (*handle && alloc_len < *clen) {
+		zs_free(zram->mem_pool, *handle);
+		*handle = 0;
+	}
+
+	if (!*handle) {
+		alloc_len = *clen;
+		*handle = zs_malloc(zram->mem_pool, alloc_len,
+				    GFP_NOWAIT | __GFP_HIGHMEM | __GFP_NOWARN);
+		if (!*handle) {
+			put_cpu_ptr(zram->workspace);
+			if (user_mem)
+				kunmap_atomic(user_mem, KM_USER0);
+
+			*handle = zs_malloc(zram->mem_pool, alloc_len,
+					    GFP_NOIO | __GFP_HIGHMEM);
+			if (!*handle) {
+				pr_info("Error allocating memory for "
+					"compressed page, size=%zu\n", *clen);
+				ret = -ENOMEM;
+				goto fail;
+			}
+			goto compress_again;
+		}
+	}
+
+	cmem = zs_map_object(zram->mem_pool, *handle, ZS_MM_WO);
+	memcpy(cmem, ws->buffer, *clen);
+	zs_unmap_object(zram->mem_pool, *handle);
+
+	if (zram->dedup_hash)
+		zram_dedup_insert(zram, *handle, *clen, checksum);
+
+	put_cpu_ptr(zram->workspace);
+	if (user_mem)
+		kunmap_atomic(user_mem, KM_USER0);
+
+	return 0;
+
+fail:
+	if (*handle)
+		zs_free(zram->mem_pool, *handle);
+	*handle = 0;
+	return ret;
+}
+
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
+	u8 flags;
 	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
-	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	unsigned long handle;
+	struct page *page;
+	unsigned char *user_mem, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -344,103 +934,64 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
+
+		/*
+		 * The read-modify-write must not race with other writes to
+		 * the same page, so partial writes keep the table locked
+		 * throughout.
+		 */
+		zram_write_lock(zram);
 		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		if (ret)
+			goto out_unlock;
+
+		user_mem = kmap_atomic(page, KM_USER0);
+		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
+		       bvec->bv_len);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		ret = zram_compress_page(zram, NULL, uncmem, &handle,
+					 &clen, &flags);
+	} else {
+		/* Full pages are compressed in parallel, without the lock */
+		ret = zram_compress_page(zram, page, NULL, &handle,
+					 &clen, &flags);
+		if (ret)
 			goto out;
-		}
+		zram_write_lock(zram);
 	}
+	if (ret)
+		goto out_unlock;
 
 	/*
 	 * System overwrites unused sectors. Free memory associated
 	 * with this sector now.
 	 */
-	if (zram->table[index].page ||
+	if (zram->table[index].handle ||
 	    zram_test_flag(zram, index, ZRAM_ZERO))
 		zram_free_page(zram, index);
 
-	user_mem = kmap_atomic(page, KM_USER0);
-
-	if (is_partial_io(bvec))
-		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
-		       bvec->bv_len);
-	else
-		uncmem = user_mem;
+	zram_touch(zram, index);
 
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
+	if (flags & BIT(ZRAM_ZERO)) {
 		zram_stat_inc(&zram->stats.pages_zero);
 		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
-		goto out;
+		goto out_unlock;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
-
-	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
-
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Compression failed! err=%d\n", ret);
-		goto out;
+	if (flags & BIT(ZRAM_SAME)) {
+		zram_stat_inc(&zram->stats.pages_same);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].handle = handle;
+		goto out_unlock;
 	}
 
-	/*
-	 * Page is incompressible. Store it as-is (uncompressed)
-	 * since we do not want to return too many disk write
-	 * errors which has side effect of hanging the system.
-	 */
-	if (unlikely(clen > max_zpage_size)) {
-		clen = PAGE_SIZE;
-		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-		if (unlikely(!page_store)) {
-			pr_info("Error allocating memory for "
-				"incompressible page: %u\n", index);
-			ret = -ENOMEM;
-			goto out;
-		}
-
-		store_offset = 0;
+	if (flags & BIT(ZRAM_UNCOMPRESSED)) {
 		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
-	}
-
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		ret = -ENOMEM;
-		goto out;
-	}
-
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
-
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
 	}
-#endif
-
-	memcpy(cmem, src, clen);
-
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	zram->table[index].handle = handle;
+	zram->table[index].size = clen;
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
@@ -448,8 +999,9 @@ memstore:
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
-	return 0;
-
+out_unlock:
+	up_write(&zram->lock);
+	kfree(uncmem);
 out:
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
@@ -464,11 +1016,11 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 	if (rw == READ) {
 		down_read(&zram->lock);
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
+		if (!ret)
+			zram_touch(zram, index);
 		up_read(&zram->lock);
 	} else {
-		down_write(&zram->lock);
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
 	}
 
 	return ret;
@@ -576,41 +1128,275 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
+static void zram_free_workspaces(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->workspace)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_workspace *ws = per_cpu_ptr(zram->workspace, cpu);
+
+		if (ws->tfm)
+			crypto_free_comp(ws->tfm);
+		free_pages((unsigned long)ws->buffer, 1);
+	}
+
+	free_percpu(zram->workspace);
+	zram->workspace = NULL;
+}
+
+/*
+ * Each CPU gets its own compressor working memory and buffer so that writes
+ * issued on different CPUs can be compressed in parallel.
+ */
+static int zram_alloc_workspaces(struct zram *zram)
+{
+	int cpu;
+
+	zram->workspace = alloc_percpu(struct zram_workspace);
+	if (!zram->workspace) {
+		pr_err("Error allocating compressor workspaces!\n");
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct zram_workspace *ws = per_cpu_ptr(zram->workspace, cpu);
+
+		ws->tfm = crypto_alloc_comp(zram->comp_algorithm, 0, 0);
+		if (IS_ERR(ws->tfm)) {
+			int ret = PTR_ERR(ws->tfm);
+
+			pr_err("Error allocating %s compressor!\n",
+			       zram->comp_algorithm);
+			ws->tfm = NULL;
+			return ret;
+		}
+
+		ws->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!ws->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static int zram_wb_candidate(struct zram *zram, u32 index, int mode)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB))
+		return 0;
+
+	if ((mode & ZRAM_WB_INCOMPRESSIBLE) &&
+	    zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 1;
+
+	if ((mode & ZRAM_WB_IDLE) &&
+	    time_after_eq(jiffies, zram->table[index].ac_time +
+			  zram->wb_idle_age * HZ))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Moves the pages selected by 'mode' to the backing device and frees their
+ * memory. The table is only locked while a page is read and when it is
+ * replaced by its block, not during the write itself; a slot rewritten or
+ * freed meanwhile loses ZRAM_UNDER_WB and keeps its new contents.
+ *
+ * Returns the number of pages written back, or a negative error.
+ */
+int zram_writeback(struct zram *zram, int mode)
+{
+	int ret = 0, count = 0;
+	unsigned long blk;
+	unsigned char *mem;
+	struct page *page;
+	u32 index;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->wb_bitmap) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_write_lock(zram);
+		if (!zram_wb_candidate(zram, index, mode)) {
+			up_write(&zram->lock);
+			continue;
+		}
+
+		mem = kmap(page);
+		ret = zram_read_before_write(zram, mem, index);
+		kunmap(page);
+		if (!ret)
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		up_write(&zram->lock);
+		if (ret)
+			break;
+
+		blk = zram_alloc_block(zram);
+		if (blk)
+			ret = zram_bdev_rw(zram, page, blk, WRITE);
+		else
+			ret = -ENOSPC;
+
+		zram_write_lock(zram);
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			up_write(&zram->lock);
+			if (blk)
+				zram_free_block(zram, blk);
+			if (ret)
+				break;
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].handle = blk;
+		zram_stat_inc(&zram->stats.pages_wb);
+		up_write(&zram->lock);
+		count++;
+
+		cond_resched();
+	}
+
+	__free_page(page);
+out:
+	mutex_unlock(&zram->init_lock);
+
+	if (ret == -ENOSPC)
+		pr_info("Backing device full, wrote back %d pages\n", count);
+	else if (ret)
+		pr_err("Writeback failed: err=%d\n", ret);
+
+	return ret && ret != -ENOSPC ? ret : count;
+}
+
+/*
+ * Sets the backing device used for writeback, or releases it if 'name' is
+ * empty. The device can only be changed while zram is not initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *name)
+{
+	struct block_device *bdev = NULL;
+	char *path = NULL;
+	int ret = 0;
+
+	if (*name) {
+		path = kstrdup(name, GFP_KERNEL);
+		if (!path)
+			return -ENOMEM;
+
+		bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE |
+					  FMODE_EXCL, zram);
+		if (IS_ERR(bdev)) {
+			kfree(path);
+			return PTR_ERR(bdev);
+		}
+	}
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	swap(zram->bdev, bdev);
+	swap(zram->backing_dev, path);
+out:
+	mutex_unlock(&zram->init_lock);
+
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	kfree(path);
+
+	return ret;
+}
+
+static int zram_wb_init(struct zram *zram)
+{
+	if (!zram->bdev)
+		return 0;
+
+	zram->wb_nr_blocks = i_size_read(zram->bdev->bd_inode) >> PAGE_SHIFT;
+	zram->wb_bitmap = vzalloc(BITS_TO_LONGS(zram->wb_nr_blocks) *
+				  sizeof(long));
+	if (!zram->wb_bitmap)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void zram_wb_destroy(struct zram *zram)
+{
+	vfree(zram->wb_bitmap);
+	zram->wb_bitmap = NULL;
+	zram->wb_nr_blocks = 0;
+}
+#else
+static inline int zram_wb_init(struct zram *zram)
+{
+	return 0;
+}
+
+static inline void zram_wb_destroy(struct zram *zram) { }
+#endif
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
+	cancel_work_sync(&zram->free_work);
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_free_workspaces(zram);
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	for (index = 0; zram->table &&
+	     index < zram->disksize >> PAGE_SHIFT; index++) {
+		unsigned long handle = zram->table[index].handle;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+			__free_page((struct page *)handle);
+		else if (!zram_dedup_put(zram, handle))
+			zs_free(zram->mem_pool, handle);
 	}
 
+	zram_dedup_destroy(zram);
+	zram_wb_destroy(zram);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	/* Slots still pending were freed with the rest above */
+	vfree(zram->free_pending);
+	zram->free_pending = NULL;
+	atomic_set(&zram->nr_free_pending, 0);
+
+	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -634,17 +1420,23 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_workspaces(zram);
+	if (ret)
+		goto fail;
+
+	ret = zram_dedup_init(zram);
+	if (ret) {
+		pr_err("Error allocating dedup hash table\n");
+		/* No table yet, so there are no entries to clean up */
+		zram->disksize = 0;
 		goto fail;
 	}
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_wb_init(zram);
+	if (ret) {
+		pr_err("Error allocating backing device bitmap\n");
+		/* No table yet, so there are no entries to clean up */
+		zram->disksize = 0;
 		goto fail;
 	}
 
@@ -658,12 +1450,20 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	zram->free_pending = vzalloc(BITS_TO_LONGS(num_pages) *
+				     sizeof(unsigned long));
+	if (!zram->free_pending) {
+		pr_err("Error allocating pending free bitmap\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -684,12 +1484,24 @@ fail:
 	return ret;
 }
 
+/*
+ * Called with swap_lock held, so this cannot sleep on zram->lock. If the
+ * table is busy, the slot is only marked and freed from free_work, or by
+ * the next writer to lock the table if that comes first.
+ */
 void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 {
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
-	zram_free_page(zram, index);
+	if (down_write_trylock(&zram->lock)) {
+		zram_free_page(zram, index);
+		up_write(&zram->lock);
+	} else {
+		if (!test_and_set_bit(index, zram->free_pending))
+			atomic_inc(&zram->nr_free_pending);
+		schedule_work(&zram->free_work);
+	}
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -703,8 +1515,12 @@ static int create_device(struct zram *zram, int device_id)
 	int ret = 0;
 
 	init_rwsem(&zram->lock);
+	INIT_WORK(&zram->free_work, zram_free_work_fn);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	strlcpy(zram->comp_algorithm, default_comp_algorithm,
+		sizeof(zram->comp_algorithm));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -836,6 +1652,9 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		zram_set_backing_dev(zram, "");
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
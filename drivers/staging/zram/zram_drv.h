@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/crypto.h>
+#include <linux/list.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,23 +29,18 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Buckets in each of the two dedup hash tables (by checksum, by handle) */
+#define ZRAM_DEDUP_HASH_BITS	12
+#define ZRAM_DEDUP_BUCKETS	(1 << ZRAM_DEDUP_HASH_BITS)
+
+/* Default compression algorithm, see the comp_algorithm sysfs node */
+static const char default_comp_algorithm[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +49,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -74,6 +72,15 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is one repeated word, kept in the table in place of handle */
+	ZRAM_SAME,
+
+	/* Page was written back, the table keeps its backing device block */
+	ZRAM_WB,
+
+	/* Page is being written back */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -81,10 +88,16 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	unsigned long handle;	/* zsmalloc handle, struct page * if
+				 * stored uncompressed, or the repeated
+				 * word of a ZRAM_SAME page, or the block
+				 * of a ZRAM_WB page */
+	u16 size;		/* compressed size */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	unsigned long ac_time;	/* jiffies of the last access */
+#endif
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -96,19 +109,51 @@ struct zram_stats {
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other same filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u64 num_compress;	/* pages run through the compressor */
+	u64 num_decompress;	/* pages run through the decompressor */
+	u64 compress_time;	/* ns spent compressing */
+	u64 decompress_time;	/* ns spent decompressing */
+	u64 dedup_hits;		/* writes that shared an existing object */
+	u64 dedup_size;		/* compr_size not stored thanks to dedup */
+	u32 pages_wb;		/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+};
+
+/* Shared compressed object, see zram_dedup_get() */
+struct zram_dedup_entry {
+	struct hlist_node csum_node;
+	struct hlist_node handle_node;
+	unsigned long handle;
+	u32 checksum;
+	u16 len;
+	unsigned int refcount;	/* table slots using the object */
+};
+
+/* Per-CPU compressor state */
+struct zram_workspace {
+	struct crypto_comp *tfm;
+	void *buffer;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_workspace __percpu *workspace;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct rw_semaphore lock; /* protect table against concurrent
+				   * read and writes */
+	/*
+	 * Slots swap freed while the table was locked, freed later under
+	 * the lock; see zram_slot_free_notify()
+	 */
+	unsigned long *free_pending;
+	atomic_t nr_free_pending;
+	struct work_struct free_work;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +164,20 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* crypto API compression algorithm, fixed while initialized */
+	char comp_algorithm[CRYPTO_MAX_ALG_NAME];
+	/* Share identical compressed pages, fixed while initialized */
+	int dedup_enable;
+	spinlock_t dedup_lock;
+	struct hlist_head *dedup_hash;	/* NULL unless dedup is enabled */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Backing device, fixed while initialized */
+	struct block_device *bdev;
+	char *backing_dev;		/* its path */
+	unsigned long *wb_bitmap;	/* blocks in use */
+	unsigned long wb_nr_blocks;
+	unsigned int wb_idle_age;	/* seconds before a page is idle */
+#endif
 
 	struct zram_stats stats;
 };
@@ -132,4 +191,13 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* zram_writeback() modes */
+#define ZRAM_WB_INCOMPRESSIBLE	(1 << 0)
+#define ZRAM_WB_IDLE		(1 << 1)
+
+extern int zram_writeback(struct zram *zram, int mode);
+extern int zram_set_backing_dev(struct zram *zram, const char *name);
+#endif
+
 #endif
@@ -0,0 +1,583 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped by size into size classes. Each class carves its
+ * objects out of zspages: groups of up to ZS_MAX_PAGES_PER_ZSPAGE pages,
+ * not necessarily physically contiguous, sized so that little is wasted
+ * at the end. Objects may straddle a page boundary within a zspage; those
+ * are copied through a per-CPU buffer when mapped.
+ *
+ * Every class has its own lock, so allocations of different sizes do not
+ * contend. Handles point to a struct zs_handle rather than at the object
+ * itself, and every object starts with a back-reference to its handle,
+ * which lets zs_compact() move objects out of sparsely used zspages and
+ * give the pages back.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Per-CPU state of the object currently mapped on that CPU */
+struct zs_map_area {
+	char *buf;		/* copy of an object spanning two pages */
+	char *kaddr;		/* kmap_atomic() address, if not spanning */
+	enum zs_mapmode mm;
+};
+
+static DEFINE_PER_CPU(struct zs_map_area, zs_map_area);
+
+/* State shared by all pools, set up when the first pool is created */
+static DEFINE_MUTEX(zs_global_lock);
+static int zs_global_users;
+static struct kmem_cache *zs_handle_cache;
+
+static void zs_global_put(void)
+{
+	int cpu;
+
+	mutex_lock(&zs_global_lock);
+	if (--zs_global_users)
+		goto out;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = &per_cpu(zs_map_area, cpu);
+
+		kfree(area->buf);
+		area->buf = NULL;
+	}
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
+	zs_handle_cache = NULL;
+out:
+	mutex_unlock(&zs_global_lock);
+}
+
+static int zs_global_get(void)
+{
+	int cpu;
+
+	mutex_lock(&zs_global_lock);
+	if (zs_global_users++)
+		goto out;
+
+	zs_handle_cache = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!zs_handle_cache)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = &per_cpu(zs_map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+out:
+	mutex_unlock(&zs_global_lock);
+	return 0;
+
+fail:
+	mutex_unlock(&zs_global_lock);
+	zs_global_put();
+	return -ENOMEM;
+}
+
+static unsigned int get_size_class_index(size_t size)
+{
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				    ZS_SIZE_CLASS_DELTA);
+	return 0;
+}
+
+/*
+ * Returns the number of pages per zspage that wastes the smallest share
+ * of the zspage at its end for objects of 'size' bytes.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int usedpc;
+
+		usedpc = (zspage_size / size) * size * 100 / zspage_size;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Copies 'len' bytes between 'buf' and the zspage, starting 'off' bytes
+ * into it, one page at a time.
+ */
+static void zs_copy_object(struct zspage *zspage, unsigned long off,
+			   char *buf, unsigned int len, int to_zspage)
+{
+	while (len) {
+		unsigned int page_off = off & ~PAGE_MASK;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - page_off);
+		char *kaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT],
+					  KM_USER1);
+
+		if (to_zspage)
+			memcpy(kaddr + page_off, buf, n);
+		else
+			memcpy(buf, kaddr + page_off, n);
+		kunmap_atomic(kaddr, KM_USER1);
+
+		off += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Objects never start at an offset that makes their handle span pages */
+static void zs_set_handle(struct zspage *zspage, unsigned long off,
+			  unsigned long handle)
+{
+	char *kaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+
+	*(unsigned long *)(kaddr + (off & ~PAGE_MASK)) = handle;
+	kunmap_atomic(kaddr, KM_USER1);
+}
+
+static unsigned long zs_get_handle(struct zspage *zspage, unsigned long off)
+{
+	char *kaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+	unsigned long handle;
+
+	handle = *(unsigned long *)(kaddr + (off & ~PAGE_MASK));
+	kunmap_atomic(kaddr, KM_USER1);
+
+	return handle;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i;
+
+	for (i = 0; i < zspage->class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	atomic_long_sub(zspage->class->pages_per_zspage,
+			&pool->pages_allocated);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				   struct size_class *class, gfp_t flags)
+{
+	unsigned int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i]) {
+			while (i--)
+				__free_page(zspage->pages[i]);
+			kfree(zspage);
+			return NULL;
+		}
+	}
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	return zspage;
+}
+
+/*
+ * Takes a free object from 'zspage' and points 'h' at it.
+ *
+ * Caller must hold class->lock.
+ */
+static void obj_alloc(struct size_class *class, struct zspage *zspage,
+		      struct zs_handle *h)
+{
+	unsigned int idx;
+
+	idx = find_first_zero_bit(zspage->used_map, class->objs_per_zspage);
+	__set_bit(idx, zspage->used_map);
+	if (++zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	h->zspage = zspage;
+	h->idx = idx;
+	zs_set_handle(zspage, (unsigned long)idx * class->size,
+		      (unsigned long)h);
+}
+
+/*
+ * Returns the object at 'idx' to 'zspage'. Returns true if the zspage is
+ * now empty, in which case it has been unlinked and must be freed.
+ *
+ * Caller must hold class->lock.
+ */
+static bool obj_free(struct size_class *class, struct zspage *zspage,
+		     unsigned int idx)
+{
+	__clear_bit(idx, zspage->used_map);
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	if (zspage->inuse)
+		return false;
+
+	list_del(&zspage->list);
+	return true;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ *
+ * This function must be called before anything when using
+ * the zsmalloc allocator.
+ *
+ * On success, a pointer to the newly created pool is returned,
+ * otherwise NULL.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	unsigned int i;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	if (zs_global_get()) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					 class->size;
+	}
+
+	rwlock_init(&pool->migrate_lock);
+	mutex_init(&pool->compact_lock);
+	atomic_long_set(&pool->pages_allocated, 0);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/*
+ * Frees the pool along with everything still allocated from it; the
+ * handles are no longer valid afterwards.
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	unsigned int i, idx;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		struct zspage *zspage, *tmp;
+
+		list_splice_init(&class->full, &class->partial);
+		list_for_each_entry_safe(zspage, tmp, &class->partial, list) {
+			for_each_set_bit(idx, zspage->used_map,
+					 class->objs_per_zspage)
+				kmem_cache_free(zs_handle_cache,
+					(void *)zs_get_handle(zspage,
+					(unsigned long)idx * class->size));
+			list_del(&zspage->list);
+			free_zspage(pool, zspage);
+		}
+	}
+
+	kfree(pool);
+	zs_global_put();
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @flags: gfp flags for any pages the pool has to grow by
+ *
+ * Returns a handle to the block, to be used with zs_map_object(), or 0 on
+ * failure. A block can be at most ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE bytes.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	struct zs_handle *h;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	h = kmem_cache_alloc(zs_handle_cache, flags & ~__GFP_HIGHMEM);
+	if (!h)
+		return 0;
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class, flags);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cache, h);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	obj_alloc(class, zspage, h);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)h;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	bool empty;
+
+	read_lock(&pool->migrate_lock);
+	zspage = h->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	empty = obj_free(class, zspage, h->idx);
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (empty)
+		free_zspage(pool, zspage);
+	kmem_cache_free(zs_handle_cache, h);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: whether the object is read, written or both
+ *
+ * Only one object can be mapped per CPU at a time, and the caller may not
+ * sleep until it calls zs_unmap_object(). Objects that straddle two pages
+ * are accessed through a per-CPU copy.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct size_class *class;
+	unsigned long off;
+
+	read_lock(&pool->migrate_lock);
+	class = h->zspage->class;
+	off = (unsigned long)h->idx * class->size;
+
+	area = &get_cpu_var(zs_map_area);
+	area->mm = mm;
+	if ((off & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		area->kaddr = kmap_atomic(h->zspage->pages[off >> PAGE_SHIFT],
+					  KM_USER1);
+		return area->kaddr + (off & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	area->kaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy_object(h->zspage, off, area->buf, class->size, 0);
+	return area->buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct size_class *class;
+	unsigned long off;
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->kaddr) {
+		kunmap_atomic(area->kaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		/* the handle at the start of the copy may be stale */
+		class = h->zspage->class;
+		off = (unsigned long)h->idx * class->size;
+		zs_copy_object(h->zspage, off + ZS_HANDLE_SIZE,
+			       area->buf + ZS_HANDLE_SIZE,
+			       class->size - ZS_HANDLE_SIZE, 1);
+	}
+	put_cpu_var(zs_map_area);
+	read_unlock(&pool->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Moves objects from the least used partial zspage of 'class' to the most
+ * used one until the former is empty or the latter is full. Returns the
+ * number of pages freed, or -1 once the free objects left in the other
+ * partial zspages could no longer take in all of the least used one.
+ *
+ * Caller must hold pool->migrate_lock for write.
+ */
+static int zs_compact_step(struct zs_pool *pool, struct size_class *class)
+{
+	struct zs_map_area *area = &__get_cpu_var(zs_map_area);
+	struct zspage *zspage, *src = NULL, *dst = NULL;
+	unsigned long nr_free = 0;
+	int freed = 0;
+
+	spin_lock(&class->lock);
+	list_for_each_entry(zspage, &class->partial, list) {
+		nr_free += class->objs_per_zspage - zspage->inuse;
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+	/* equally used zspages still compact, so dst is any but src */
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (zspage != src && (!dst || zspage->inuse > dst->inuse))
+			dst = zspage;
+	}
+	if (!dst ||
+	    nr_free - (class->objs_per_zspage - src->inuse) < src->inuse) {
+		spin_unlock(&class->lock);
+		return -1;
+	}
+
+	while (src->inuse && dst->inuse < class->objs_per_zspage) {
+		unsigned int sidx, didx;
+		unsigned long soff, doff;
+		struct zs_handle *h;
+
+		sidx = find_first_bit(src->used_map, class->objs_per_zspage);
+		didx = find_first_zero_bit(dst->used_map,
+					   class->objs_per_zspage);
+		soff = (unsigned long)sidx * class->size;
+		doff = (unsigned long)didx * class->size;
+
+		/* nothing is mapped on this CPU while we hold the lock */
+		zs_copy_object(src, soff, area->buf, class->size, 0);
+		zs_copy_object(dst, doff, area->buf, class->size, 1);
+
+		h = (struct zs_handle *)zs_get_handle(src, soff);
+		h->zspage = dst;
+		h->idx = didx;
+
+		__set_bit(didx, dst->used_map);
+		if (++dst->inuse == class->objs_per_zspage)
+			list_move(&dst->list, &class->full);
+		if (obj_free(class, src, sidx))
+			freed = class->pages_per_zspage;
+	}
+	spin_unlock(&class->lock);
+
+	if (freed)
+		free_zspage(pool, src);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Free up sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Objects are migrated into the fullest zspages of their size class so
+ * that the emptiest ones can be freed. May sleep. Returns the number of
+ * pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	unsigned int i;
+	int ret;
+
+	mutex_lock(&pool->compact_lock);
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		do {
+			write_lock(&pool->migrate_lock);
+			ret = zs_compact_step(pool, &pool->size_class[i]);
+			write_unlock(&pool->migrate_lock);
+
+			if (ret > 0)
+				freed += ret;
+			cond_resched();
+		} while (ret >= 0);
+	}
+	pool->pages_compacted += freed;
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+u64 zs_get_pages_compacted(struct zs_pool *pool)
+{
+	u64 val;
+
+	mutex_lock(&pool->compact_lock);
+	val = pool->pages_compacted;
+	mutex_unlock(&pool->compact_lock);
+
+	return val;
+}
+EXPORT_SYMBOL_GPL(zs_get_pages_compacted);
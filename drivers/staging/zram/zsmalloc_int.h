@@ -0,0 +1,91 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is made of up to this many, not necessarily contiguous,
+ * pages; objects may straddle page boundaries within it.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* Each object starts with a back-reference to its handle */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+/* This must be at least ZS_HANDLE_SIZE and a multiple of ZS_SIZE_CLASS_DELTA */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes. This is 16 for
+ * 4k pages; since objects never start at an offset that isn't a multiple of
+ * it, a handle never straddles two pages.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+#define ZS_MAX_OBJS_PER_ZSPAGE	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / \
+					ZS_MIN_ALLOC_SIZE)
+
+/* End of user params */
+
+/*
+ * Handles given out by zs_malloc() point to one of these, so objects can be
+ * moved by compaction without their users noticing.
+ */
+struct zs_handle {
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct zspage {
+	struct list_head list;		/* entry in the class partial/full list */
+	struct size_class *class;
+	unsigned int inuse;		/* objects allocated */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long used_map[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+	unsigned int size;		/* object size, handle included */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	/*
+	 * Held for read while objects are mapped or freed, and for write by
+	 * compaction while it moves objects around.
+	 */
+	rwlock_t migrate_lock;
+	struct mutex compact_lock;	/* one compaction at a time */
+
+	atomic_long_t pages_allocated;
+	u64 pages_compacted;		/* protected by compact_lock */
+};
+
+#endif
@@ -36,6 +36,9 @@ pid_t nvhost_debug_force_timeout_pid;
 u32 nvhost_debug_force_timeout_val;
 u32 nvhost_debug_force_timeout_channel;
 
+/* syncpoint waits poll for this long before sleeping */
+u32 nvhost_debug_syncpt_spin_us = 20;
+
 void nvhost_debug_output(struct output *o, const char* fmt, ...)
 {
 	va_list args;
@@ -134,6 +137,39 @@ static const struct file_operations nvhost_debug_fops = {
 	.release	= single_release,
 };
 
+static int nvhost_debug_wait_hist_show(struct seq_file *s, void *unused)
+{
+	struct nvhost_master *m = s->private;
+	struct nvhost_syncpt *sp = &m->syncpt;
+	int i;
+
+	seq_printf(s, "spun %d slept %d\n", atomic_read(&sp->wait_spun),
+		   atomic_read(&sp->wait_slept));
+	for (i = 0; i < NVHOST_SYNCPT_WAIT_HIST; i++) {
+		int count = atomic_read(&sp->wait_hist[i]);
+
+		if (!count)
+			continue;
+		if (i == NVHOST_SYNCPT_WAIT_HIST - 1)
+			seq_printf(s, ">= %u us: %d\n", 1U << (i - 1), count);
+		else
+			seq_printf(s, "< %u us: %d\n", 1U << i, count);
+	}
+	return 0;
+}
+
+static int nvhost_debug_wait_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvhost_debug_wait_hist_show, inode->i_private);
+}
+
+static const struct file_operations nvhost_debug_wait_hist_fops = {
+	.open		= nvhost_debug_wait_hist_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 void nvhost_debug_init(struct nvhost_master *master)
 {
 	struct dentry *de = debugfs_create_dir("tegra_host", NULL);
@@ -155,6 +191,11 @@ void nvhost_debug_init(struct nvhost_master *master)
 			&nvhost_debug_force_timeout_val);
 	debugfs_create_u32("force_timeout_channel", S_IRUGO|S_IWUSR, de,
 			&nvhost_debug_force_timeout_channel);
+
+	debugfs_create_u32("syncpt_spin_us", S_IRUGO|S_IWUSR, de,
+			&nvhost_debug_syncpt_spin_us);
+	debugfs_create_file("syncpt_wait_hist", S_IRUGO, de,
+			master, &nvhost_debug_wait_hist_fops);
 }
 #else
 void nvhost_debug_init(struct nvhost_master *master)
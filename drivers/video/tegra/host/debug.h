@@ -46,5 +46,6 @@ extern pid_t nvhost_debug_force_timeout_pid;
 extern u32 nvhost_debug_force_timeout_val;
 extern u32 nvhost_debug_force_timeout_channel;
 extern unsigned int nvhost_debug_trace_cmdbuf;
+extern u32 nvhost_debug_syncpt_spin_us;
 
 #endif /*__NVHOST_DEBUG_H */
@@ -18,6 +18,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/ktime.h>
 #include <linux/nvhost_ioctl.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
@@ -25,6 +26,7 @@
 #include "nvhost_syncpt.h"
 #include "nvhost_acm.h"
 #include "dev.h"
+#include "debug.h"
 
 #define MAX_SYNCPT_LENGTH 5
 /* Name of sysfs node for min and max value */
@@ -142,6 +144,49 @@ static bool syncpt_update_min_is_expired(
 	return nvhost_syncpt_is_expired(sp, id, thresh);
 }
 
+/**
+ * Polls the syncpoint for up to nvhost_debug_syncpt_spin_us before the
+ * caller falls back to an interrupt driven sleep. Syncpoints whose recent
+ * waits took much longer than the budget are not polled at all.
+ */
+static bool syncpt_spin_is_expired(
+	struct nvhost_syncpt *sp,
+	u32 id,
+	u32 thresh)
+{
+	u32 budget = nvhost_debug_syncpt_spin_us;
+	ktime_t start;
+
+	if (!budget || sp->wait_avg_us[id] > 2 * budget)
+		return false;
+
+	start = ktime_get();
+	do {
+		cpu_relax();
+		if (syncpt_update_min_is_expired(sp, id, thresh))
+			return true;
+	} while (!need_resched() &&
+		 ktime_us_delta(ktime_get(), start) < budget);
+
+	return false;
+}
+
+/**
+ * Accounts a wait that could not be satisfied from the shadow values.
+ */
+static void syncpt_wait_account(
+	struct nvhost_syncpt *sp,
+	u32 id,
+	ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	u32 clamped = (u32)clamp_t(s64, us, 0, UINT_MAX / 8);
+	int bucket = min(fls(clamped), NVHOST_SYNCPT_WAIT_HIST - 1);
+
+	atomic_inc(&sp->wait_hist[bucket]);
+	sp->wait_avg_us[id] = (sp->wait_avg_us[id] * 7 + clamped) / 8;
+}
+
 /**
  * Main entrypoint for syncpoint value waits.
  */
@@ -152,6 +197,7 @@ int nvhost_syncpt_wait_timeout(struct nvhost_syncpt *sp, u32 id,
 	void *ref;
 	void *waiter;
 	int err = 0, check_count = 0, low_timeout = 0;
+	ktime_t start;
 	u32 val;
 
 	if (value)
@@ -180,6 +226,17 @@ int nvhost_syncpt_wait_timeout(struct nvhost_syncpt *sp, u32 id,
 		goto done;
 	}
 
+	/* most waits in a frame loop end within microseconds, so poll
+	 * briefly before paying for a waiter and an interrupt */
+	start = ktime_get();
+	if (syncpt_spin_is_expired(sp, id, thresh)) {
+		if (value)
+			*value = nvhost_syncpt_read_min(sp, id);
+		atomic_inc(&sp->wait_spun);
+		syncpt_wait_account(sp, id, start);
+		goto done;
+	}
+
 	/* schedule a wakeup when the syncpoint value is reached */
 	waiter = nvhost_intr_alloc_waiter();
 	if (!waiter) {
@@ -235,6 +292,9 @@ int nvhost_syncpt_wait_timeout(struct nvhost_syncpt *sp, u32 id,
 		}
 	}
 	nvhost_intr_put_ref(&(syncpt_to_dev(sp)->intr), ref);
+	atomic_inc(&sp->wait_slept);
+	if (!err)
+		syncpt_wait_account(sp, id, start);
 
 done:
 	nvhost_module_idle(syncpt_to_dev(sp)->dev);
@@ -376,8 +436,10 @@ int nvhost_syncpt_init(struct nvhost_device *dev,
 	sp->max_val = kzalloc(sizeof(atomic_t) * sp->nb_pts, GFP_KERNEL);
 	sp->base_val = kzalloc(sizeof(u32) * sp->nb_bases, GFP_KERNEL);
 	sp->lock_counts = kzalloc(sizeof(atomic_t) * sp->nb_mlocks, GFP_KERNEL);
+	sp->wait_avg_us = kzalloc(sizeof(u32) * sp->nb_pts, GFP_KERNEL);
 
-	if (!(sp->min_val && sp->max_val && sp->base_val && sp->lock_counts)) {
+	if (!(sp->min_val && sp->max_val && sp->base_val && sp->lock_counts &&
+	      sp->wait_avg_us)) {
 		/* frees happen in the deinit */
 		err = -ENOMEM;
 		goto fail;
@@ -456,6 +518,9 @@ void nvhost_syncpt_deinit(struct nvhost_syncpt *sp)
 	kfree(sp->lock_counts);
 	sp->lock_counts = 0;
 
+	kfree(sp->wait_avg_us);
+	sp->wait_avg_us = NULL;
+
 	kfree(sp->syncpt_attrs);
 	sp->syncpt_attrs = NULL;
 }
@@ -31,6 +31,9 @@
 #define NVSYNCPT_GRAPHICS_HOST		     (0)
 #define NVSYNCPT_INVALID		     (-1)
 
+/* wait durations are binned by powers of two microseconds */
+#define NVHOST_SYNCPT_WAIT_HIST		20
+
 /* Attribute struct for sysfs min and max attributes */
 struct nvhost_syncpt_attr {
 	struct kobj_attribute attr;
@@ -49,6 +52,10 @@ struct nvhost_syncpt {
 	atomic_t *lock_counts;
 	u32 nb_mlocks;
 	struct nvhost_syncpt_attr *syncpt_attrs;
+	u32 *wait_avg_us;	/* decaying average of waits per syncpoint */
+	atomic_t wait_hist[NVHOST_SYNCPT_WAIT_HIST];
+	atomic_t wait_spun;	/* waits that ended while spinning */
+	atomic_t wait_slept;	/* waits that had to sleep */
 };
 
 int nvhost_syncpt_init(struct nvhost_device *, struct nvhost_syncpt *);
@@ -45,6 +45,7 @@ static void map_iovmm_area(struct nvmap_handle *h)
 {
 	tegra_iovmm_addr_t va;
 	unsigned long i;
+	ktime_t start = ktime_get();
 
 	BUG_ON(!h->heap_pgalloc || !h->pgalloc.area);
 	BUG_ON(h->size & ~PAGE_MASK);
@@ -58,25 +59,25 @@ static void map_iovmm_area(struct nvmap_handle *h)
 					  page_to_pfn(h->pgalloc.pages[i]));
 	}
 	h->pgalloc.dirty = false;
+	nvmap_mru_account_remap(nvmap_get_share_from_dev(h->dev),
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
 }
 
 /* must be called inside nvmap_pin_lock, to ensure that an entire stream
  * of pins will complete without racing with a second stream. handle should
  * have nvmap_handle_get (or nvmap_validate_get) called before calling
- * this function. */
-static int pin_locked(struct nvmap_client *client, struct nvmap_handle *h)
+ * this function. the caller also holds the MRU lock. */
+static int pin_mru_locked(struct nvmap_client *client, struct nvmap_handle *h)
 {
 	struct tegra_iovmm_area *area;
 	BUG_ON(!h->alloc);
 
-	nvmap_mru_lock(client->share);
 	if (atomic_inc_return(&h->pin) == 1) {
 		if (h->heap_pgalloc && !h->pgalloc.contig) {
 			area = nvmap_handle_iovmm_locked(client, h);
 			if (!area) {
 				/* no race here, inside the pin mutex */
 				atomic_dec(&h->pin);
-				nvmap_mru_unlock(client->share);
 				return -ENOMEM;
 			}
 			if (area != h->pgalloc.area)
@@ -84,23 +85,30 @@ static int pin_locked(struct nvmap_client *client, struct nvmap_handle *h)
 			h->pgalloc.area = area;
 		}
 	}
-	nvmap_mru_unlock(client->share);
 	return 0;
 }
 
-/* doesn't need to be called inside nvmap_pin_lock, since this will only
- * expand the available VM area */
-static int handle_unpin(struct nvmap_client *client,
-		struct nvmap_handle *h, int free_vm)
+static int pin_locked(struct nvmap_client *client, struct nvmap_handle *h)
 {
-	int ret = 0;
+	int err;
+
 	nvmap_mru_lock(client->share);
+	err = pin_mru_locked(client, h);
+	nvmap_mru_unlock(client->share);
+	return err;
+}
 
+/* drops one pin from a handle; must be called with the MRU lock held.
+ * unless free_vm is set, the IOVMM area stays mapped on the MRU lists and
+ * is only reclaimed when a later pin runs out of IOVMM space. the caller
+ * drops the handle reference once the MRU lock is released. */
+static int handle_unpin_mru_locked(struct nvmap_client *client,
+		struct nvmap_handle *h, int free_vm)
+{
 	if (atomic_read(&h->pin) == 0) {
 		nvmap_err(client, "%s unpinning unpinned handle %p\n",
 			  current->group_leader->comm, h);
-		nvmap_mru_unlock(client->share);
-		return 0;
+		return -EINVAL;
 	}
 
 	BUG_ON(!h->alloc);
@@ -118,16 +126,48 @@ static int handle_unpin(struct nvmap_client *client,
 				h->pgalloc.area = NULL;
 			} else
 				nvmap_mru_insert_locked(client->share, h);
-			ret = 1;
+			return 1;
 		}
 	}
+	return 0;
+}
+
+/* unpins an array of handles under a single hold of the MRU lock and
+ * drops the references taken when they were pinned; entries for handles
+ * that weren't pinned are cleared. doesn't need to be called inside
+ * nvmap_pin_lock, since this will only expand the available VM area;
+ * returns nonzero if pin_wait should be woken. */
+static int handle_unpin_array(struct nvmap_client *client,
+		struct nvmap_handle **h, int count, int free_vm)
+{
+	int ret = 0;
+	int i;
 
+	nvmap_mru_lock(client->share);
+	for (i = 0; i < count; i++) {
+		int w = handle_unpin_mru_locked(client, h[i], free_vm);
+		if (w < 0)
+			h[i] = NULL;
+		else
+			ret |= w;
+	}
 	nvmap_mru_unlock(client->share);
-	nvmap_handle_put(h);
+
+	for (i = 0; i < count; i++)
+		if (h[i])
+			nvmap_handle_put(h[i]);
 	return ret;
 }
 
-static int pin_array_locked(struct nvmap_client *client,
+static int handle_unpin(struct nvmap_client *client,
+		struct nvmap_handle *h, int free_vm)
+{
+	return handle_unpin_array(client, &h, 1, free_vm);
+}
+
+/* pins every handle of the array in one pass under a single hold of the
+ * MRU lock; on failure, the handles pinned so far are unpinned again. */
+static int pin_array_mru_locked(struct nvmap_client *client,
 		struct nvmap_handle **h, int count)
 {
 	int pinned;
@@ -135,21 +175,26 @@ static int pin_array_locked(struct nvmap_client *client,
 	int err = 0;
 
 	for (pinned = 0; pinned < count; pinned++) {
-		err = pin_locked(client, h[pinned]);
+		err = pin_mru_locked(client, h[pinned]);
 		if (err)
 			break;
 	}
 
-	if (err) {
-		/* unpin pinned handles */
-		for (i = 0; i < pinned; i++) {
-			/* inc ref counter, because
-			 * handle_unpin decrements it */
-			nvmap_handle_get(h[i]);
-			/* unpin handles and free vm */
-			handle_unpin(client, h[i], true);
-		}
-	}
+	/* unpin pinned handles and free vm; the references taken by the
+	 * caller are kept, so handle_unpin_mru_locked doesn't drop them */
+	for (i = 0; err && i < pinned; i++)
+		handle_unpin_mru_locked(client, h[i], true);
+
+	return err;
+}
+
+static int pin_array_locked(struct nvmap_client *client,
+		struct nvmap_handle **h, int count)
+{
+	int err;
+
+	nvmap_mru_lock(client->share);
+	err = pin_array_mru_locked(client, h, count);
 
 	if (err && tegra_iovmm_get_max_free(client->share->iovmm) >=
 							client->iovm_limit) {
@@ -161,16 +206,13 @@ static int pin_array_locked(struct nvmap_client *client,
 		 * We have to do pinning again here since there might be is
 		 * no more incoming pin_wait wakeup calls from unpin
 		 * operations */
-		for (pinned = 0; pinned < count; pinned++) {
-			err = pin_locked(client, h[pinned]);
-			if (err)
-				break;
-		}
+		err = pin_array_mru_locked(client, h, count);
 		if (err) {
 			pr_err("Pinning in empty iovmm failed!!!\n");
 			BUG_ON(1);
 		}
 	}
+	nvmap_mru_unlock(client->share);
 	return err;
 }
 
@@ -209,42 +251,50 @@ static int handle_unpin_noref(struct nvmap_client *client, unsigned long id)
 	return w;
 }
 
+#define UNPIN_BATCH	16
+
+/* unpins a list of handle_ref objects. the ids are validated in batches
+ * under one hold of the ref lock, and each batch is then unpinned under
+ * one hold of the MRU lock; pin_wait is woken once for the whole list. */
 void nvmap_unpin_ids(struct nvmap_client *client,
 		     unsigned int nr, const unsigned long *ids)
 {
-	unsigned int i;
+	struct nvmap_handle *batch[UNPIN_BATCH];
+	unsigned int i = 0;
 	int do_wake = 0;
+	int n;
 
-	for (i = 0; i < nr; i++) {
-		struct nvmap_handle_ref *ref;
-
-		if (!ids[i])
-			continue;
-
+	while (i < nr) {
+		n = 0;
 		nvmap_ref_lock(client);
-		ref = _nvmap_validate_id_locked(client, ids[i]);
-		if (ref) {
-			struct nvmap_handle *h = ref->handle;
-			int e = atomic_add_unless(&ref->pin, -1, 0);
+		for (; i < nr && n < UNPIN_BATCH; i++) {
+			struct nvmap_handle_ref *ref;
 
-			nvmap_ref_unlock(client);
+			if (!ids[i])
+				continue;
 
-			if (!e) {
-				nvmap_err(client, "%s unpinning unpinned "
-					  "handle %08lx\n",
-					  current->group_leader->comm, ids[i]);
-			} else {
-				do_wake |= handle_unpin(client, h, false);
-			}
-		} else {
-			nvmap_ref_unlock(client);
-			if (client->super)
+			ref = _nvmap_validate_id_locked(client, ids[i]);
+			if (ref) {
+				if (atomic_add_unless(&ref->pin, -1, 0))
+					batch[n++] = ref->handle;
+				else
+					nvmap_err(client, "%s unpinning unpinned "
+						  "handle %08lx\n",
+						  current->group_leader->comm,
+						  ids[i]);
+			} else if (client->super) {
+				nvmap_ref_unlock(client);
 				do_wake |= handle_unpin_noref(client, ids[i]);
-			else
+				nvmap_ref_lock(client);
+			} else {
 				nvmap_err(client, "%s unpinning invalid "
 					  "handle %08lx\n",
 					  current->group_leader->comm, ids[i]);
+			}
 		}
+		nvmap_ref_unlock(client);
+
+		do_wake |= handle_unpin_array(client, batch, n, false);
 	}
 
 	if (do_wake)
@@ -424,6 +474,8 @@ static int nvmap_reloc_pin_array(struct nvmap_client *client,
 
 		reloc_addr = handle_phys(pin) + arr[i].pin_offset;
 		reloc_addr >>= arr[i].reloc_shift;
+		/* the mapping may be cacheable, so a later clean is needed */
+		nvmap_handle_cpu_access(patch, NVMAP_CPU_CLEAN);
 		__raw_writel(reloc_addr, addr + (phys & ~PAGE_MASK));
 	}
 
@@ -660,9 +712,17 @@ void *nvmap_mmap(struct nvmap_handle_ref *ref)
 
 	prot = nvmap_pgprot(h, pgprot_kernel);
 
-	if (h->heap_pgalloc)
-		return vm_map_ram(h->pgalloc.pages, h->size >> PAGE_SHIFT,
-				  -1, prot);
+	if (h->heap_pgalloc) {
+		p = vm_map_ram(h->pgalloc.pages, h->size >> PAGE_SHIFT,
+			       -1, prot);
+		if (p) {
+			/* CPU accesses through the kernel mapping aren't
+			 * tracked, so keep cache maintenance on for now */
+			atomic_inc(&h->kmap_count);
+			nvmap_handle_cpu_access(h, NVMAP_CPU_CLEAN);
+		}
+		return p;
+	}
 
 	/* carveout - explicitly map the pfns into a vmalloc area */
 
@@ -728,6 +788,7 @@ void nvmap_munmap(struct nvmap_handle_ref *ref, void *addr)
 
 	if (h->heap_pgalloc) {
 		vm_unmap_ram(addr, h->size >> PAGE_SHIFT);
+		atomic_dec(&h->kmap_count);
 	} else {
 		struct vm_struct *vm;
 		addr -= (h->carveout->base & ~PAGE_MASK);
@@ -863,6 +924,7 @@ int nvmap_patch_word(struct nvmap_client *client,
 	flush_tlb_kernel_page(kaddr);
 
 	/* write patch_value to addr + page offset */
+	nvmap_handle_cpu_access(patch, NVMAP_CPU_CLEAN);
 	__raw_writel(patch_value, addr + (phys & ~PAGE_MASK));
 
 	nvmap_free_pte(client->dev, pte);
@@ -61,6 +61,7 @@ struct nvmap_pgalloc {
 	bool contig;			/* contiguous system memory */
 	bool dirty;			/* area is invalid and needs mapping */
 	u32 iovm_addr;	/* is non-zero, if client need specific iova mapping */
+	unsigned int reuse;	/* pins that found the area still mapped */
 };
 
 struct nvmap_handle {
@@ -84,8 +85,31 @@ struct nvmap_handle {
 	bool alloc;		/* handle has memory allocated */
 	unsigned int userflags;	/* flags passed from userspace */
 	struct mutex lock;
+	atomic_t umap_count;	/* user VMAs mapping the handle */
+	atomic_t kmap_count;	/* kernel mappings from nvmap_mmap */
+	atomic_t cpu_state;	/* NVMAP_CPU_* bits and access generation */
 };
 
+/* cpu_state tracks whether a clean of a page-allocated handle can be
+ * skipped. the bit is only set after maintenance covered the whole handle
+ * through its sole mapping, which is then zapped so that the next CPU write
+ * faults and clears it again; every access also bumps the generation so
+ * that a racing fault is never lost. invalidates are never skipped: the
+ * kernel linear mapping stays cacheable, so lines can be refilled
+ * speculatively whether or not the CPU touched the handle. */
+#define NVMAP_CPU_CLEAN		(1 << 0)	/* not written since cleaned */
+#define NVMAP_CPU_GEN		(1 << 1)
+
+static inline void nvmap_handle_cpu_access(struct nvmap_handle *h, int bits)
+{
+	int old, new;
+
+	do {
+		old = atomic_read(&h->cpu_state);
+		new = (int)((unsigned int)old + NVMAP_CPU_GEN) & ~bits;
+	} while (atomic_cmpxchg(&h->cpu_state, old, new) != old);
+}
+
 #ifdef CONFIG_NVMAP_PAGE_POOLS
 #define NVMAP_UC_POOL NVMAP_HANDLE_UNCACHEABLE
 #define NVMAP_WC_POOL NVMAP_HANDLE_WRITE_COMBINE
@@ -100,6 +124,10 @@ struct nvmap_page_pool {
 	struct page **shrink_array;
 	int max_pages;
 	int flags;
+	u64 hits;		/* pages handed out from the pool */
+	u64 misses;		/* pages allocated as the pool was empty */
+	u64 refill_pages;	/* pages added by the refill thread */
+	u64 refill_ns;		/* time spent adding them */
 };
 
 int nvmap_page_pool_init(struct nvmap_page_pool *pool, int flags);
@@ -124,7 +152,16 @@ struct nvmap_share {
 	struct mutex mru_lock;
 	struct list_head *mru_lists;
 	int nr_mru;
+	/* protected by mru_lock */
+	u64 mru_hits;		/* pins that found their area still mapped */
+	u64 mru_misses;		/* pins that needed a new area */
+	u64 mru_evictions;	/* areas taken from unpinned handles */
+	u64 mru_remaps;		/* areas the pages were mapped into */
+	u64 mru_remap_ns;	/* time spent mapping them */
 #endif
+	atomic64_t cache_maint_done;	/* user cache ops carried out */
+	atomic64_t cache_maint_skipped;	/* ... skipped on untouched handles */
+	atomic64_t cache_maint_full;	/* ops done on the whole cache */
 };
 
 struct nvmap_carveout_commit {
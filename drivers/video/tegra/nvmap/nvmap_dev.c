@@ -28,6 +28,7 @@
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
+#include <linux/pagemap.h>
 #include <linux/platform_device.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -98,6 +99,8 @@ static int nvmap_map(struct file *filp, struct vm_area_struct *vma);
 static void nvmap_vma_open(struct vm_area_struct *vma);
 static void nvmap_vma_close(struct vm_area_struct *vma);
 static int nvmap_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf);
+static int nvmap_vma_page_mkwrite(struct vm_area_struct *vma,
+				  struct vm_fault *vmf);
 
 static const struct file_operations nvmap_user_fops = {
 	.owner		= THIS_MODULE,
@@ -119,6 +122,7 @@ static struct vm_operations_struct nvmap_vma_ops = {
 	.open		= nvmap_vma_open,
 	.close		= nvmap_vma_close,
 	.fault		= nvmap_vma_fault,
+	.page_mkwrite	= nvmap_vma_page_mkwrite,
 };
 
 int is_nvmap_vma(struct vm_area_struct *vma)
@@ -885,6 +889,8 @@ static void nvmap_vma_open(struct vm_area_struct *vma)
 	BUG_ON(!priv);
 
 	atomic_inc(&priv->count);
+	if (priv->handle)
+		atomic_inc(&priv->handle->umap_count);
 }
 
 static void nvmap_vma_close(struct vm_area_struct *vma)
@@ -895,6 +901,7 @@ static void nvmap_vma_close(struct vm_area_struct *vma)
 		if (priv->handle) {
 			nvmap_usecount_dec(priv->handle);
 			BUG_ON(priv->handle->usecount < 0);
+			atomic_dec(&priv->handle->umap_count);
 		}
 		if (!atomic_dec_return(&priv->count)) {
 			if (priv->handle)
@@ -923,6 +930,8 @@ static int nvmap_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	if (offs >= priv->handle->size)
 		return VM_FAULT_SIGBUS;
 
+	nvmap_handle_cpu_access(priv->handle, NVMAP_CPU_CLEAN);
+
 	if (!priv->handle->heap_pgalloc) {
 		unsigned long pfn;
 		BUG_ON(priv->handle->carveout->base & ~PAGE_MASK);
@@ -940,6 +949,22 @@ static int nvmap_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	}
 }
 
+/* the mapping is write-notify, so the first CPU write to a page after it
+ * was faulted in read-only, or after nvmap_ioctl_cache_maint zapped it,
+ * lands here. the pages have no address space, so they are returned locked
+ * to keep the fault path from retrying on a NULL page->mapping. */
+static int nvmap_vma_page_mkwrite(struct vm_area_struct *vma,
+				  struct vm_fault *vmf)
+{
+	struct nvmap_vma_priv *priv = vma->vm_private_data;
+
+	if (priv && priv->handle)
+		nvmap_handle_cpu_access(priv->handle, NVMAP_CPU_CLEAN);
+
+	lock_page(vmf->page);
+	return VM_FAULT_LOCKED;
+}
+
 static ssize_t attr_show_usage(struct device *dev,
 			       struct device_attribute *attr, char *buf)
 {
@@ -1142,6 +1167,180 @@ static const struct file_operations debug_iovmm_allocations_fops = {
 	.release = single_release,
 };
 
+/*
+ * Synthetic frame benchmark for pinning.  Writing "<handles> <frames>" to
+ * iovmm/pin_bench allocates <handles> IOVMM buffers of mixed sizes, then
+ * pins and unpins all of them once per frame, first with a single
+ * nvmap_pin_ids()/nvmap_unpin_ids() call for the whole array and then with
+ * one call per handle.  Reading the file shows the result of the last run.
+ */
+#define PIN_BENCH_MAX_HANDLES	64
+#define PIN_BENCH_MAX_FRAMES	10000
+
+static DEFINE_MUTEX(pin_bench_lock);
+static unsigned int pin_bench_handles;
+static unsigned int pin_bench_frames;
+static s64 pin_bench_batched_ns;
+static s64 pin_bench_single_ns;
+
+/* returns the time taken in ns, or a negative error */
+static s64 pin_bench_frames_run(struct nvmap_client *client,
+				unsigned long *ids, unsigned int nr,
+				unsigned int frames, bool batched)
+{
+	ktime_t start = ktime_get();
+	unsigned int f, i;
+	int err;
+
+	for (f = 0; f < frames; f++) {
+		if (batched) {
+			err = nvmap_pin_ids(client, nr, ids);
+			if (err)
+				return err;
+			nvmap_unpin_ids(client, nr, ids);
+			continue;
+		}
+		for (i = 0; i < nr; i++) {
+			err = nvmap_pin_ids(client, 1, &ids[i]);
+			if (err) {
+				nvmap_unpin_ids(client, i, ids);
+				return err;
+			}
+		}
+		for (i = 0; i < nr; i++)
+			nvmap_unpin_ids(client, 1, &ids[i]);
+	}
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static int pin_bench_run(struct nvmap_device *dev, unsigned int nr,
+			 unsigned int frames)
+{
+	static const size_t sizes[] = { 64 << 10, 256 << 10, 1 << 20 };
+	struct nvmap_handle_ref **refs;
+	struct nvmap_client *client;
+	unsigned long *ids;
+	s64 batched, single;
+	unsigned int i;
+	int err = 0;
+
+	client = nvmap_create_client(dev, "pin_bench");
+	refs = kcalloc(nr, sizeof(*refs), GFP_KERNEL);
+	ids = kcalloc(nr, sizeof(*ids), GFP_KERNEL);
+	if (!client || !refs || !ids) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		refs[i] = nvmap_alloc(client, sizes[i % ARRAY_SIZE(sizes)],
+				      PAGE_SIZE, NVMAP_HANDLE_WRITE_COMBINE,
+				      NVMAP_HEAP_IOVMM);
+		if (IS_ERR(refs[i])) {
+			err = PTR_ERR(refs[i]);
+			refs[i] = NULL;
+			goto out;
+		}
+		ids[i] = nvmap_ref_to_id(refs[i]);
+	}
+
+	/* one untimed frame so that both runs start with mapped areas */
+	batched = pin_bench_frames_run(client, ids, nr, 1, true);
+	if (batched >= 0)
+		batched = pin_bench_frames_run(client, ids, nr, frames, true);
+	if (batched < 0) {
+		err = batched;
+		goto out;
+	}
+	single = pin_bench_frames_run(client, ids, nr, frames, false);
+	if (single < 0) {
+		err = single;
+		goto out;
+	}
+
+	pin_bench_handles = nr;
+	pin_bench_frames = frames;
+	pin_bench_batched_ns = batched;
+	pin_bench_single_ns = single;
+
+out:
+	for (i = 0; refs && i < nr && refs[i]; i++)
+		nvmap_free(client, refs[i]);
+	kfree(ids);
+	kfree(refs);
+	if (client)
+		nvmap_client_put(client);
+	return err;
+}
+
+static int nvmap_debug_pin_bench_show(struct seq_file *s, void *unused)
+{
+	mutex_lock(&pin_bench_lock);
+	if (!pin_bench_frames) {
+		seq_printf(s, "write \"<handles> <frames>\" to run\n");
+	} else {
+		seq_printf(s, "%u handles, %u frames\n", pin_bench_handles,
+			   pin_bench_frames);
+		seq_printf(s, "batched   %10lld ns/frame\n",
+			   div_s64(pin_bench_batched_ns, pin_bench_frames));
+		seq_printf(s, "unbatched %10lld ns/frame\n",
+			   div_s64(pin_bench_single_ns, pin_bench_frames));
+	}
+	mutex_unlock(&pin_bench_lock);
+
+	return 0;
+}
+
+static ssize_t nvmap_debug_pin_bench_write(struct file *file,
+					   const char __user *user_buf,
+					   size_t count, loff_t *ppos)
+{
+	struct nvmap_device *dev =
+		((struct seq_file *)file->private_data)->private;
+	unsigned int nr, frames;
+	char buf[32];
+	int err;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, user_buf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%u %u", &nr, &frames) != 2 || !nr ||
+	    nr > PIN_BENCH_MAX_HANDLES || !frames ||
+	    frames > PIN_BENCH_MAX_FRAMES)
+		return -EINVAL;
+
+	mutex_lock(&pin_bench_lock);
+	err = pin_bench_run(dev, nr, frames);
+	mutex_unlock(&pin_bench_lock);
+
+	return err ? err : count;
+}
+
+static int nvmap_debug_pin_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvmap_debug_pin_bench_show, inode->i_private);
+}
+
+static const struct file_operations debug_pin_bench_fops = {
+	.open = nvmap_debug_pin_bench_open,
+	.read = seq_read,
+	.write = nvmap_debug_pin_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int nvmap_debug_atomic64_get(void *data, u64 *val)
+{
+	*val = atomic64_read((atomic64_t *)data);
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(debug_atomic64_fops, nvmap_debug_atomic64_get,
+			NULL, "%llu\n");
+
 static int nvmap_probe(struct platform_device *pdev)
 {
 	struct nvmap_platform_data *plat = pdev->dev.platform_data;
@@ -1305,6 +1504,19 @@ static int nvmap_probe(struct platform_device *pdev)
 			}
 		}
 	}
+	if (!IS_ERR_OR_NULL(nvmap_debug_root)) {
+		struct nvmap_share *share = &dev->iovmm_master;
+
+		debugfs_create_file("cache_maint_done", S_IRUGO,
+			nvmap_debug_root, &share->cache_maint_done,
+			&debug_atomic64_fops);
+		debugfs_create_file("cache_maint_skipped", S_IRUGO,
+			nvmap_debug_root, &share->cache_maint_skipped,
+			&debug_atomic64_fops);
+		debugfs_create_file("cache_maint_full", S_IRUGO,
+			nvmap_debug_root, &share->cache_maint_full,
+			&debug_atomic64_fops);
+	}
 	if (!IS_ERR_OR_NULL(nvmap_debug_root)) {
 		struct dentry *iovmm_root =
 			debugfs_create_dir("iovmm", nvmap_debug_root);
@@ -1313,16 +1525,48 @@ static int nvmap_probe(struct platform_device *pdev)
 				dev, &debug_iovmm_clients_fops);
 			debugfs_create_file("allocations", 0664, iovmm_root,
 				dev, &debug_iovmm_allocations_fops);
+			debugfs_create_file("pin_bench", S_IRUGO | S_IWUSR,
+				iovmm_root, dev, &debug_pin_bench_fops);
+#ifdef CONFIG_NVMAP_RECLAIM_UNPINNED_VM
+			debugfs_create_u64("mru_hits", S_IRUGO, iovmm_root,
+				&dev->iovmm_master.mru_hits);
+			debugfs_create_u64("mru_misses", S_IRUGO, iovmm_root,
+				&dev->iovmm_master.mru_misses);
+			debugfs_create_u64("mru_evictions", S_IRUGO,
+				iovmm_root, &dev->iovmm_master.mru_evictions);
+			debugfs_create_u64("mru_remaps", S_IRUGO, iovmm_root,
+				&dev->iovmm_master.mru_remaps);
+			debugfs_create_u64("mru_remap_ns", S_IRUGO, iovmm_root,
+				&dev->iovmm_master.mru_remap_ns);
+#endif
 #ifdef CONFIG_NVMAP_PAGE_POOLS
 			for (i = 0; i < NVMAP_NUM_POOLS; i++) {
 				char name[40];
 				char *memtype_string[] = {"uc", "wc",
 							  "iwb", "wb"};
+				struct nvmap_page_pool *pool =
+					&dev->iovmm_master.pools[i];
+
 				sprintf(name, "%s_page_pool_available_pages",
 					memtype_string[i]);
 				debugfs_create_u32(name, S_IRUGO|S_IWUSR,
-					iovmm_root,
-					&dev->iovmm_master.pools[i].npages);
+					iovmm_root, &pool->npages);
+				sprintf(name, "%s_page_pool_hits",
+					memtype_string[i]);
+				debugfs_create_u64(name, S_IRUGO,
+					iovmm_root, &pool->hits);
+				sprintf(name, "%s_page_pool_misses",
+					memtype_string[i]);
+				debugfs_create_u64(name, S_IRUGO,
+					iovmm_root, &pool->misses);
+				sprintf(name, "%s_page_pool_refill_pages",
+					memtype_string[i]);
+				debugfs_create_u64(name, S_IRUGO,
+					iovmm_root, &pool->refill_pages);
+				sprintf(name, "%s_page_pool_refill_ns",
+					memtype_string[i]);
+				debugfs_create_u64(name, S_IRUGO,
+					iovmm_root, &pool->refill_ns);
 			}
 #endif
 		}
@@ -30,6 +30,8 @@
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 
 #include <asm/cacheflush.h>
 #include <asm/outercache.h>
@@ -77,6 +79,28 @@ static char *s_memtype_str[] = {
 	"wb",
 };
 
+typedef int (*set_pages_array) (struct page **pages, int addrinarray);
+static set_pages_array s_cpa[] = {
+	set_pages_array_uc,
+	set_pages_array_wc,
+	set_pages_array_iwb,
+	set_pages_array_wb
+};
+
+/* the uc and wc pools are refilled in the background to this percentage
+ * of their size with zeroed pages whose attributes are already set, so
+ * that allocations do not have to do it inline. */
+#define NVMAP_PP_REFILL_BATCH	32
+#define NVMAP_PP_REFILL_BACKOFF	HZ	/* no refill this soon after a shrink */
+#define GFP_NVMAP_REFILL	(GFP_NVMAP | __GFP_NORETRY | __GFP_ZERO)
+static int refill_watermark = 25;
+module_param_named(page_pool_refill_watermark, refill_watermark, int, 0644);
+
+static struct task_struct *refill_task;
+static DECLARE_WAIT_QUEUE_HEAD(refill_wait);
+static atomic_t refill_pending = ATOMIC_INIT(0);
+static unsigned long last_shrink;
+
 static inline void nvmap_page_pool_lock(struct nvmap_page_pool *pool)
 {
 	mutex_lock(&pool->lock);
@@ -96,16 +120,36 @@ static struct page *nvmap_page_pool_alloc_locked(struct nvmap_page_pool *pool)
 	return page;
 }
 
-static struct page *nvmap_page_pool_alloc(struct nvmap_page_pool *pool)
+static int nvmap_page_pool_refill_target(struct nvmap_page_pool *pool)
 {
-	struct page *page = NULL;
+	if (pool->flags != NVMAP_UC_POOL && pool->flags != NVMAP_WC_POOL)
+		return 0;
+	return pool->max_pages * clamp(refill_watermark, 0, 100) / 100;
+}
 
-	if (pool) {
-		nvmap_page_pool_lock(pool);
-		page = nvmap_page_pool_alloc_locked(pool);
-		nvmap_page_pool_unlock(pool);
+/* takes up to nr pages from the pool, returns how many it got */
+static int nvmap_page_pool_alloc_pages(struct nvmap_page_pool *pool,
+				       struct page **pages, int nr)
+{
+	int i = 0;
+	bool refill;
+
+	if (!pool)
+		return 0;
+
+	nvmap_page_pool_lock(pool);
+	while (i < nr && pool->npages > 0)
+		pages[i++] = nvmap_page_pool_alloc_locked(pool);
+	pool->hits += i;
+	pool->misses += nr - i;
+	refill = pool->npages < nvmap_page_pool_refill_target(pool);
+	nvmap_page_pool_unlock(pool);
+
+	if (refill && refill_task) {
+		atomic_set(&refill_pending, 1);
+		wake_up(&refill_wait);
 	}
-	return page;
+	return i;
 }
 
 static bool nvmap_page_pool_release_locked(struct nvmap_page_pool *pool,
@@ -239,6 +283,7 @@ static int nvmap_page_pool_shrink(struct shrinker *shrinker,
 		goto out;
 
 	pr_debug("sh_pages=%d", shrink_pages);
+	last_shrink = jiffies;
 
 	for (i = 0; i < NVMAP_NUM_POOLS && shrink_pages; i++) {
 		pool_offset = atomic_add_return(1, &start_pool) %
@@ -255,6 +300,72 @@ static struct shrinker nvmap_page_pool_shrinker = {
 	.seeks = 1,
 };
 
+static void nvmap_page_pool_refill(struct nvmap_page_pool *pool)
+{
+	struct page *pages[NVMAP_PP_REFILL_BATCH];
+	ktime_t start;
+	int want, nr, i;
+
+	while (enable_pp && !kthread_should_stop() &&
+	       !time_in_range(jiffies, last_shrink,
+			      last_shrink + NVMAP_PP_REFILL_BACKOFF)) {
+		nvmap_page_pool_lock(pool);
+		want = nvmap_page_pool_refill_target(pool) - pool->npages;
+		nvmap_page_pool_unlock(pool);
+		if (want <= 0)
+			return;
+		want = min(want, NVMAP_PP_REFILL_BATCH);
+
+		start = ktime_get();
+		for (nr = 0; nr < want; nr++) {
+			pages[nr] = alloc_page(GFP_NVMAP_REFILL);
+			if (!pages[nr])
+				break;
+		}
+		if (nr)
+			(*s_cpa[pool->flags])(pages, nr);
+
+		nvmap_page_pool_lock(pool);
+		for (i = 0; i < nr; i++)
+			if (!nvmap_page_pool_release_locked(pool, pages[i]))
+				break;
+		pool->refill_pages += i;
+		pool->refill_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+		nvmap_page_pool_unlock(pool);
+
+		/* the pool shrank or was disabled under us */
+		if (i < nr) {
+			set_pages_array_wb(&pages[i], nr - i);
+			for (; i < nr; i++)
+				__free_page(pages[i]);
+			return;
+		}
+		if (nr < want)
+			return;
+		cond_resched();
+	}
+}
+
+static int nvmap_page_pool_refill_thread(void *data)
+{
+	struct nvmap_share *share;
+
+	set_freezable();
+	set_user_nice(current, 10);
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(refill_wait,
+				     atomic_read(&refill_pending) ||
+				     kthread_should_stop());
+		atomic_set(&refill_pending, 0);
+
+		share = nvmap_get_share_from_dev(nvmap_dev);
+		nvmap_page_pool_refill(&share->uc_pool);
+		nvmap_page_pool_refill(&share->wc_pool);
+	}
+	return 0;
+}
+
 static void shrink_page_pools(int *total_pages, int *available_pages)
 {
 	struct shrink_control sc;
@@ -378,13 +489,6 @@ int nvmap_page_pool_init(struct nvmap_page_pool *pool, int flags)
 	static int reg = 1;
 	struct sysinfo info;
 	int highmem_pages = 0;
-	typedef int (*set_pages_array) (struct page **pages, int addrinarray);
-	set_pages_array s_cpa[] = {
-		set_pages_array_uc,
-		set_pages_array_wc,
-		set_pages_array_iwb,
-		set_pages_array_wb
-	};
 
 	BUG_ON(flags >= NVMAP_NUM_POOLS);
 	memset(pool, 0x0, sizeof(*pool));
@@ -417,6 +521,12 @@ int nvmap_page_pool_init(struct nvmap_page_pool *pool, int flags)
 	if (reg) {
 		reg = 0;
 		register_shrinker(&nvmap_page_pool_shrinker);
+		refill_task = kthread_run(nvmap_page_pool_refill_thread, NULL,
+					  "nvmap_pp_refill");
+		if (IS_ERR(refill_task)) {
+			pr_err("failed to start page pool refill thread");
+			refill_task = NULL;
+		}
 	}
 
 	nvmap_page_pool_lock(pool);
@@ -583,13 +693,9 @@ static int handle_page_alloc(struct nvmap_client *client,
 		if (h->flags < NVMAP_NUM_POOLS)
 			pool = &share->pools[h->flags];
 
-		for (i = 0; i < nr_page; i++) {
-			/* Get pages from pool, if available. */
-			pages[i] = nvmap_page_pool_alloc(pool);
-			if (!pages[i])
-				break;
-			page_index++;
-		}
+		/* Get pages from pool, if available. */
+		page_index = nvmap_page_pool_alloc_pages(pool, pages, nr_page);
+		i = page_index;
 #endif
 		for (; i < nr_page; i++) {
 			pages[i] = nvmap_alloc_pages_exact(GFP_NVMAP,
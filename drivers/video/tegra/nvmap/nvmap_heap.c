@@ -50,13 +50,14 @@
  * to employ should be provided by the platform for each heap. it is possible
  * for a platform to define a heap where only the "normal" strategy is used.
  *
- * o "normal" allocations use an address-order first-fit allocator (called
- *   BOTTOM_UP in the code below). each allocation is rounded up to be
- *   an integer multiple of the "small" allocation size.
+ * o "normal" allocations are carved from the bottom of the free block they
+ *   are placed in (called BOTTOM_UP in the code below). each allocation is
+ *   rounded up to be an integer multiple of the "small" allocation size.
  *
- * o "huge" allocations use an address-order last-fit allocator (called
- *   TOP_DOWN in the code below). like "normal" allocations, each allocation
- *   is rounded up to be an integer multiple of the "small" allocation size.
+ * o "huge" allocations are carved from the top of the free block they are
+ *   placed in (called TOP_DOWN in the code below). like "normal"
+ *   allocations, each allocation is rounded up to be an integer multiple of
+ *   the "small" allocation size.
  *
  * o "small" allocations are treated differently: the heap manager maintains
  *   a pool of "small"-sized blocks internally from which allocations less
@@ -68,10 +69,20 @@
  * and to ensure that the minimum free block size in the carveout (i.e., the
  * "small" threshold) is still a meaningful size.
  *
+ * free blocks are kept on segregated lists, one per power-of-two size class,
+ * with a bitmap of the non-empty classes. an allocation looks at the class
+ * its size falls in and then at the next non-empty classes up, so it does
+ * not have to walk every free block in the heap. blocks on all_list are
+ * kept in address order, which is how freed blocks find the free neighbours
+ * they coalesce with.
+ *
  */
 
 #define MAX_BUDDY_NR	128	/* maximum buddies in a buddy allocator */
 
+/* free list class n holds blocks of [2^n, 2^(n+1)) bytes */
+#define NR_FREE_CLASSES	BITS_PER_LONG
+
 enum direction {
 	TOP_DOWN,
 	BOTTOM_UP
@@ -135,7 +146,8 @@ struct buddy_heap {
 
 struct nvmap_heap {
 	struct list_head all_list;
-	struct list_head free_list;
+	struct list_head free_lists[NR_FREE_CLASSES];
+	unsigned long free_map;		/* classes with free blocks */
 	struct mutex lock;
 	struct list_head buddy_list;
 	unsigned int min_buddy_shift;
@@ -160,6 +172,24 @@ static inline unsigned int order_of(size_t len, size_t min_shift)
 	return fls(len)-1;
 }
 
+static void free_list_add(struct nvmap_heap *heap, struct list_block *b)
+{
+	unsigned int class = __fls(b->size);
+
+	list_add(&b->free_list, &heap->free_lists[class]);
+	__set_bit(class, &heap->free_map);
+}
+
+/* must be called before the size of the block changes */
+static void free_list_del(struct nvmap_heap *heap, struct list_block *b)
+{
+	unsigned int class = __fls(b->size);
+
+	list_del(&b->free_list);
+	if (list_empty(&heap->free_lists[class]))
+		__clear_bit(class, &heap->free_map);
+}
+
 /* returns the free size in bytes of the buddy heap; must be called while
  * holding the parent heap's lock. */
 static void buddy_stat(struct buddy_heap *heap, struct heap_stat *stat)
@@ -191,6 +221,7 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 	struct buddy_heap *bh;
 	struct list_block *l = NULL;
 	unsigned long base = -1ul;
+	unsigned int class;
 
 	memset(stat, 0, sizeof(*stat));
 	mutex_lock(&heap->lock);
@@ -210,10 +241,12 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 		stat->count--;
 	}
 
-	list_for_each_entry(l, &heap->free_list, free_list) {
-		stat->free += l->size;
-		stat->free_count++;
-		stat->free_largest = max(l->size, stat->free_largest);
+	for_each_set_bit(class, &heap->free_map, NR_FREE_CLASSES) {
+		list_for_each_entry(l, &heap->free_lists[class], free_list) {
+			stat->free += l->size;
+			stat->free_count++;
+			stat->free_largest = max(l->size, stat->free_largest);
+		}
 	}
 	mutex_unlock(&heap->lock);
 
@@ -384,6 +417,71 @@ static struct buddy_heap *do_buddy_free(struct nvmap_heap_block *block)
 }
 
 
+/* checks whether free block b can hold len bytes aligned to align, and
+ * where they would start */
+static bool block_fits(struct list_block *b, size_t len, size_t align,
+		       enum direction dir, unsigned long *fix_base)
+{
+	if (b->size < len)
+		return false;
+
+	if (dir == BOTTOM_UP) {
+		*fix_base = ALIGN(b->block.base, align);
+		return *fix_base - b->block.base <= b->size - len;
+	}
+
+	*fix_base = (b->block.base + b->size - len) & ~(align - 1);
+	return *fix_base >= b->block.base;
+}
+
+static struct list_block *find_free_block(struct nvmap_heap *heap,
+					  size_t len, size_t align,
+					  enum direction dir,
+					  unsigned long base_max,
+					  unsigned long *fix_base)
+{
+	struct list_block *i;
+	unsigned int class;
+	unsigned int fit_class;
+
+	/* needed for compaction: the lowest block that fits, so that the
+	 * relocated chunk never goes up */
+	if (base_max) {
+		list_for_each_entry(i, &heap->all_list, all_list) {
+			if (i->block.base > base_max)
+				break;
+			if (i->block.type != BLOCK_EMPTY)
+				continue;
+			if (block_fits(i, len, align, BOTTOM_UP, fix_base) &&
+			    *fix_base <= base_max)
+				return i;
+		}
+		return NULL;
+	}
+
+	/* every block from fit_class up is at least len bytes, so only the
+	 * alignment can get in the way and the first block looked at
+	 * usually fits. the class len falls in may hold blocks that are too
+	 * small, so it is only walked when nothing above it is free */
+	fit_class = fls_long(len - 1);
+	for (class = find_next_bit(&heap->free_map, NR_FREE_CLASSES, fit_class);
+	     class < NR_FREE_CLASSES;
+	     class = find_next_bit(&heap->free_map, NR_FREE_CLASSES, class + 1)) {
+		list_for_each_entry(i, &heap->free_lists[class], free_list) {
+			if (block_fits(i, len, align, dir, fix_base))
+				return i;
+		}
+	}
+
+	if (fit_class == __fls(len))
+		return NULL;
+	list_for_each_entry(i, &heap->free_lists[__fls(len)], free_list) {
+		if (block_fits(i, len, align, dir, fix_base))
+			return i;
+	}
+	return NULL;
+}
+
 /*
  * base_max limits position of allocated chunk in memory.
  * if base_max is 0 then there is no such limitation.
@@ -394,7 +492,6 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 					      unsigned long base_max)
 {
 	struct list_block *b = NULL;
-	struct list_block *i = NULL;
 	struct list_block *rem = NULL;
 	unsigned long fix_base;
 	enum direction dir;
@@ -416,40 +513,12 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 	dir = (len <= heap->small_alloc) ? BOTTOM_UP : TOP_DOWN;
 #endif
 
-	if (dir == BOTTOM_UP) {
-		list_for_each_entry(i, &heap->free_list, free_list) {
-			size_t fix_size;
-			fix_base = ALIGN(i->block.base, align);
-			fix_size = i->size - (fix_base - i->block.base);
-
-			/* needed for compaction. relocated chunk
-			 * should never go up */
-			if (base_max && fix_base > base_max)
-				break;
-
-			if (fix_size >= len) {
-				b = i;
-				break;
-			}
-		}
-	} else {
-		list_for_each_entry_reverse(i, &heap->free_list, free_list) {
-			if (i->size >= len) {
-				fix_base = i->block.base + i->size - len;
-				fix_base &= ~(align-1);
-				if (fix_base >= i->block.base) {
-					b = i;
-					break;
-				}
-			}
-		}
-	}
-
+	b = find_free_block(heap, len, align, dir, base_max, &fix_base);
 	if (!b)
 		return NULL;
 
-	if (dir == BOTTOM_UP)
-		b->block.type = BLOCK_FIRST_FIT;
+	free_list_del(heap, b);
+	b->block.type = BLOCK_FIRST_FIT;
 
 	/* split free block */
 	if (b->block.base != fix_base) {
@@ -470,7 +539,7 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		b->orig_addr = fix_base;
 		b->size -= rem->size;
 		list_add_tail(&rem->all_list,  &b->all_list);
-		list_add_tail(&rem->free_list, &b->free_list);
+		free_list_add(heap, rem);
 	}
 
 	b->orig_addr = b->block.base;
@@ -488,11 +557,10 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		rem->orig_addr = rem->block.base;
 		b->size = len;
 		list_add(&rem->all_list,  &b->all_list);
-		list_add(&rem->free_list, &b->free_list);
+		free_list_add(heap, rem);
 	}
 
 out:
-	list_del(&b->free_list);
 	b->heap = heap;
 	b->mem_prot = mem_prot;
 	b->align = align;
@@ -508,7 +576,9 @@ static void freelist_debug(struct nvmap_heap *heap, const char *title,
 
 	dev_debug(&heap->dev, "%s\n", title);
 	i = 0;
-	list_for_each_entry(n, &heap->free_list, free_list) {
+	list_for_each_entry(n, &heap->all_list, all_list) {
+		if (n->block.type != BLOCK_EMPTY && n != token)
+			continue;
 		dev_debug(&heap->dev, "\t%d [%p..%p]%s\n", i, (void *)n->orig_addr,
 			  (void *)(n->orig_addr + n->size),
 			  (n == token) ? "<--" : "");
@@ -530,48 +600,38 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 	b->block.base = b->orig_addr;
 
 	freelist_debug(heap, "free list before", b);
-
-	/* Find position of first free block to the right of freed one */
-	list_for_each_entry(n, &heap->free_list, free_list) {
-		if (n->block.base > b->block.base)
-			break;
-	}
-
-	/* Add freed block before found free one */
-	list_add_tail(&b->free_list, &n->free_list);
 	BUG_ON(list_empty(&b->all_list));
 
-	freelist_debug(heap, "free list pre-merge", b);
-
-	/* merge freed block with next if they connect
+	/* merge freed block with next if it is free
 	 * freed block becomes bigger, next one is destroyed */
-	if (!list_is_last(&b->free_list, &heap->free_list)) {
-		n = list_first_entry(&b->free_list, struct list_block, free_list);
-		if (n->block.base == b->block.base + b->size) {
+	if (!list_is_last(&b->all_list, &heap->all_list)) {
+		n = list_first_entry(&b->all_list, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY) {
+			BUG_ON(n->block.base != b->block.base + b->size);
+			free_list_del(heap, n);
 			list_del(&n->all_list);
-			list_del(&n->free_list);
-			BUG_ON(b->orig_addr >= n->orig_addr);
 			b->size += n->size;
 			kmem_cache_free(block_cache, n);
 		}
 	}
 
-	/* merge freed block with prev if they connect
+	/* merge freed block with prev if it is free
 	 * previous free block becomes bigger, freed one is destroyed */
-	if (b->free_list.prev != &heap->free_list) {
-		n = list_entry(b->free_list.prev, struct list_block, free_list);
-		if (n->block.base + n->size == b->block.base) {
+	if (b->all_list.prev != &heap->all_list) {
+		n = list_entry(b->all_list.prev, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY) {
+			BUG_ON(n->block.base + n->size != b->block.base);
+			free_list_del(heap, n);
 			list_del(&b->all_list);
-			list_del(&b->free_list);
-			BUG_ON(n->orig_addr >= b->orig_addr);
 			n->size += b->size;
 			kmem_cache_free(block_cache, b);
 			b = n;
 		}
 	}
 
-	freelist_debug(heap, "free list after", b);
 	b->block.type = BLOCK_EMPTY;
+	free_list_add(heap, b);
+	freelist_debug(heap, "free list after", b);
 	return b;
 }
 
@@ -944,6 +1004,7 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 {
 	struct nvmap_heap *h = NULL;
 	struct list_block *l = NULL;
+	unsigned int class;
 
 	if (WARN_ON(buddy_size && buddy_size < NVMAP_HEAP_MIN_BUDDY_SIZE)) {
 		dev_warn(parent, "%s: buddy_size %u too small\n", __func__,
@@ -1004,7 +1065,8 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	h->buddy_heap_size = buddy_size;
 	if (buddy_size)
 		h->min_buddy_shift = ilog2(buddy_size / MAX_BUDDY_NR);
-	INIT_LIST_HEAD(&h->free_list);
+	for (class = 0; class < NR_FREE_CLASSES; class++)
+		INIT_LIST_HEAD(&h->free_lists[class]);
 	INIT_LIST_HEAD(&h->buddy_list);
 	INIT_LIST_HEAD(&h->all_list);
 	mutex_init(&h->lock);
@@ -1012,7 +1074,7 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	l->block.type = BLOCK_EMPTY;
 	l->size = len;
 	l->orig_addr = base;
-	list_add_tail(&l->free_list, &h->free_list);
+	free_list_add(h, l);
 	list_add_tail(&l->all_list, &h->all_list);
 
 	inner_flush_cache_all();
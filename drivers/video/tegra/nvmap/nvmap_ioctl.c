@@ -23,6 +23,7 @@
 #include <linux/dma-mapping.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 
@@ -46,13 +47,27 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 		       unsigned long start, unsigned long end, unsigned int op);
 
+/* clean ops from userspace are skipped for handles the CPU has not written
+ * since their last maintenance, see nvmap_handle_cpu_access */
+static bool lazy_cache_maint = true;
+module_param(lazy_cache_maint, bool, 0644);
 
+/* ranges of at least this many bytes are cleaned by flushing the whole
+ * inner cache instead of walking them line by line */
+static unsigned int full_threshold = FLUSH_CLEAN_BY_SET_WAY_THRESHOLD;
+module_param_named(cache_maint_full_threshold, full_threshold, uint, 0644);
+
+
+/* the handles of a multi-handle op are copied in and pinned as one batch,
+ * and the resulting addresses are gathered behind them in the same buffer
+ * so that they can be copied out with a single copy_to_user. */
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 {
 	struct nvmap_pin_handle op;
 	struct nvmap_handle *h;
-	unsigned long on_stack[16];
+	unsigned long on_stack[32];
 	unsigned long *refs;
+	unsigned long *addrs;
 	unsigned long __user *output;
 	unsigned int i;
 	int err = 0;
@@ -60,14 +75,15 @@ int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 	if (copy_from_user(&op, arg, sizeof(op)))
 		return -EFAULT;
 
-	if (!op.count)
+	if (!op.count || op.count > INT_MAX / (2 * sizeof(*refs)))
 		return -EINVAL;
 
 	if (op.count > 1) {
 		size_t bytes = op.count * sizeof(unsigned long *);
 
-		if (op.count > ARRAY_SIZE(on_stack))
-			refs = kmalloc(op.count * sizeof(*refs), GFP_KERNEL);
+		if (op.count > ARRAY_SIZE(on_stack) / 2)
+			refs = kmalloc(op.count * 2 * sizeof(*refs),
+				       GFP_KERNEL);
 		else
 			refs = on_stack;
 
@@ -105,23 +121,22 @@ int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 	if (!output)
 		goto out;
 
-	for (i = 0; i < op.count && !err; i++) {
-		unsigned long addr;
-
+	addrs = refs + op.count;
+	for (i = 0; i < op.count; i++) {
 		h = (struct nvmap_handle *)refs[i];
 
 		if (h->heap_pgalloc && h->pgalloc.contig)
-			addr = page_to_phys(h->pgalloc.pages[0]);
+			addrs[i] = page_to_phys(h->pgalloc.pages[0]);
 		else if (h->heap_pgalloc)
-			addr = h->pgalloc.area->iovm_start;
+			addrs[i] = h->pgalloc.area->iovm_start;
 		else
-			addr = h->carveout->base;
-
-		err = put_user(addr, &output[i]);
+			addrs[i] = h->carveout->base;
 	}
 
-	if (err)
+	if (copy_to_user(output, addrs, op.count * sizeof(*addrs))) {
+		err = -EFAULT;
 		nvmap_unpin_ids(filp->private_data, op.count, refs);
+	}
 
 out:
 	if (refs != on_stack)
@@ -283,6 +298,7 @@ int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg)
 
 	vpriv->handle = h;
 	vpriv->offs = op.offset;
+	atomic_inc(&h->umap_count);
 
 	cache_flags = op.flags & NVMAP_HANDLE_CACHE_FLAG;
 	if ((cache_flags == NVMAP_HANDLE_INNER_CACHEABLE ||
@@ -434,8 +450,12 @@ int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg)
 	struct nvmap_cache_op op;
 	struct vm_area_struct *vma;
 	struct nvmap_vma_priv *vpriv;
+	struct nvmap_handle *h;
 	unsigned long start;
 	unsigned long end;
+	bool track;
+	bool excl;
+	int state;
 	int err = 0;
 
 	if (copy_from_user(&op, arg, sizeof(op)))
@@ -445,7 +465,12 @@ int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg)
 	    op.op > NVMAP_CACHE_OP_WB_INV)
 		return -EINVAL;
 
-	down_read(&current->mm->mmap_sem);
+	excl = false;
+again:
+	if (excl)
+		down_write(&current->mm->mmap_sem);
+	else
+		down_read(&current->mm->mmap_sem);
 
 	vma = find_vma(current->active_mm, (unsigned long)op.addr);
 	if (!vma || !is_nvmap_vma(vma) ||
@@ -464,9 +489,49 @@ int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg)
 	start = (unsigned long)op.addr - vma->vm_start;
 	end = start + op.len;
 
-	err = cache_maint(client, vpriv->handle, start, end, op.op);
+	h = vpriv->handle;
+	state = atomic_read(&h->cpu_state);
+	if (lazy_cache_maint && op.op == NVMAP_CACHE_OP_WB &&
+	    (state & NVMAP_CPU_CLEAN)) {
+		atomic64_inc(&client->share->cache_maint_skipped);
+		goto out;
+	}
+
+	/* with the sole mapping covering the whole handle, the CPU can't
+	 * write it again without faulting once the mapping is zapped, so
+	 * the handle is clean after any op unless such a fault raced */
+	track = lazy_cache_maint && h->heap_pgalloc && !vpriv->offs &&
+		!vma->vm_pgoff && !start && end >= h->size &&
+		atomic_read(&h->umap_count) == 1 &&
+		!atomic_read(&h->kmap_count);
+
+	/* the state snapshot, the zap and the final cmpxchg must not race
+	 * with a fault on the mapping: a fault could mark the access before
+	 * the snapshot but install its PTE only after the zap, leaving a
+	 * live mapping behind a handle recorded as clean.  Only this path
+	 * needs to hold off faults, so retry it with mmap_sem held for
+	 * write rather than taking that for every op */
+	if (track && !excl) {
+		up_read(&current->mm->mmap_sem);
+		excl = true;
+		goto again;
+	}
+	if (track)
+		zap_page_range(vma, vma->vm_start,
+			       vma->vm_end - vma->vm_start, NULL);
+
+	err = cache_maint(client, h, start, end, op.op);
+	if (err)
+		goto out;
+
+	atomic64_inc(&client->share->cache_maint_done);
+	if (track)
+		atomic_cmpxchg(&h->cpu_state, state, state | NVMAP_CPU_CLEAN);
 out:
-	up_read(&current->mm->mmap_sem);
+	if (excl)
+		up_write(&current->mm->mmap_sem);
+	else
+		up_read(&current->mm->mmap_sem);
 	return err;
 }
 
@@ -541,9 +606,11 @@ static bool fast_cache_maint(struct nvmap_client *client, struct nvmap_handle *h
 	int ret = false;
 
 	if ((op == NVMAP_CACHE_OP_INV) ||
-		((end - start) < FLUSH_CLEAN_BY_SET_WAY_THRESHOLD))
+		((end - start) < full_threshold))
 		goto out;
 
+	atomic64_inc(&client->share->cache_maint_full);
+
 	if (op == NVMAP_CACHE_OP_WB_INV)
 		inner_flush_cache_all();
 	else if (op == NVMAP_CACHE_OP_WB)
@@ -708,6 +775,8 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 	if (!h->alloc)
 		return -EFAULT;
 
+	nvmap_handle_cpu_access(h, NVMAP_CPU_CLEAN);
+
 	if (elem_size == h_stride && elem_size == sys_stride) {
 		elem_size *= count;
 		h_stride = elem_size;
@@ -22,6 +22,7 @@
 
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/moduleparam.h>
 
 #include <asm/pgtable.h>
 
@@ -38,12 +39,30 @@
  * if a handle is located on the MRU list, then the code below may
  * steal its IOVMM area at any time to satisfy a pin operation if no
  * free IOVMM space is available
+ *
+ * the "freq" eviction policy instead keeps two lists in least-recently-
+ * unpinned order: handles whose area has not been reused since it was
+ * mapped wait on the probation list, and handles that were pinned again
+ * while still mapped move to the protected list. areas are stolen from
+ * probation first, preferring one big enough to be reused as is, so
+ * buffers that are pinned over and over survive a stream of one-shot ones.
  */
 
 static const size_t mru_cutoff[] = {
 	262144, 393216, 786432, 1048576, 1572864
 };
 
+enum {
+	MRU_POLICY_SIZE,
+	MRU_POLICY_FREQ,
+};
+
+static const char *mru_policy_names[] = { "size", "freq" };
+static int mru_policy = MRU_POLICY_SIZE;
+
+#define MRU_PROBATION	0
+#define MRU_PROTECTED	1
+
 static inline struct list_head *mru_list(struct nvmap_share *share, size_t size)
 {
 	unsigned int i;
@@ -66,7 +85,90 @@ size_t nvmap_mru_vm_size(struct tegra_iovmm_client *iovmm)
 void nvmap_mru_insert_locked(struct nvmap_share *share, struct nvmap_handle *h)
 {
 	size_t len = h->pgalloc.area->iovm_length;
-	list_add(&h->pgalloc.mru_list, mru_list(share, len));
+
+	if (mru_policy == MRU_POLICY_FREQ)
+		list_add_tail(&h->pgalloc.mru_list, &share->mru_lists[
+			h->pgalloc.reuse ? MRU_PROTECTED : MRU_PROBATION]);
+	else
+		list_add(&h->pgalloc.mru_list, mru_list(share, len));
+}
+
+/* takes the IOVMM area away from an unpinned handle and returns it */
+static struct tegra_iovmm_area *mru_evict_locked(struct nvmap_share *share,
+						 struct nvmap_handle *evict)
+{
+	struct tegra_iovmm_area *vm = evict->pgalloc.area;
+
+	BUG_ON(atomic_read(&evict->pin) != 0);
+	BUG_ON(!vm);
+	list_del(&evict->pgalloc.mru_list);
+	INIT_LIST_HEAD(&evict->pgalloc.mru_list);
+	evict->pgalloc.area = NULL;
+	evict->pgalloc.reuse = 0;
+	share->mru_evictions++;
+	return vm;
+}
+
+/* moves all unpinned handles onto the lists of the current policy */
+static void mru_requeue_locked(struct nvmap_share *share)
+{
+	struct nvmap_handle *h, *n;
+	LIST_HEAD(all);
+	int i;
+
+	for (i = 0; i < share->nr_mru; i++)
+		list_splice_tail_init(&share->mru_lists[i], &all);
+
+	list_for_each_entry_safe(h, n, &all, pgalloc.mru_list) {
+		list_del(&h->pgalloc.mru_list);
+		nvmap_mru_insert_locked(share, h);
+	}
+}
+
+static int mru_policy_set(const char *val, const struct kernel_param *kp)
+{
+	struct nvmap_share *share;
+	int policy;
+
+	for (policy = 0; policy < ARRAY_SIZE(mru_policy_names); policy++)
+		if (sysfs_streq(val, mru_policy_names[policy]))
+			break;
+	if (policy == ARRAY_SIZE(mru_policy_names))
+		return -EINVAL;
+
+	if (!nvmap_dev) {
+		mru_policy = policy;
+		return 0;
+	}
+
+	share = nvmap_get_share_from_dev(nvmap_dev);
+	nvmap_mru_lock(share);
+	if (policy != mru_policy) {
+		mru_policy = policy;
+		mru_requeue_locked(share);
+	}
+	nvmap_mru_unlock(share);
+	return 0;
+}
+
+static int mru_policy_get(char *buf, const struct kernel_param *kp)
+{
+	return sprintf(buf, "%s", mru_policy_names[mru_policy]);
+}
+
+static struct kernel_param_ops mru_policy_ops = {
+	.get = mru_policy_get,
+	.set = mru_policy_set,
+};
+
+module_param_cb(eviction_policy, &mru_policy_ops, &mru_policy, 0644);
+
+void nvmap_mru_account_remap(struct nvmap_share *share, s64 ns)
+{
+	nvmap_mru_lock(share);
+	share->mru_remaps++;
+	share->mru_remap_ns += ns;
+	nvmap_mru_unlock(share);
 }
 
 void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
@@ -78,6 +180,39 @@ void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
 	INIT_LIST_HEAD(&h->pgalloc.mru_list);
 }
 
+/* eviction for the "freq" policy: reuse the least recently unpinned area
+ * on probation that is big enough, else free areas from the probation and
+ * then the protected list until the new allocation succeeds. */
+static struct tegra_iovmm_area *mru_evict_freq_locked(struct nvmap_client *c,
+						      struct nvmap_handle *h,
+						      pgprot_t prot)
+{
+	struct nvmap_share *share = c->share;
+	struct tegra_iovmm_area *vm = NULL;
+	struct nvmap_handle *evict;
+	struct list_head *mru;
+	int i;
+
+	mru = &share->mru_lists[MRU_PROBATION];
+	list_for_each_entry(evict, mru, pgalloc.mru_list) {
+		if (evict->pgalloc.area->iovm_length >= h->size)
+			return mru_evict_locked(share, evict);
+	}
+
+	for (i = MRU_PROBATION; i <= MRU_PROTECTED && !vm; i++) {
+		mru = &share->mru_lists[i];
+		while (!list_empty(mru) && !vm) {
+			evict = list_first_entry(mru, struct nvmap_handle,
+						 pgalloc.mru_list);
+			tegra_iovmm_free_vm(mru_evict_locked(share, evict));
+			vm = tegra_iovmm_create_vm(share->iovmm, NULL,
+					h->size, h->align, prot,
+					h->pgalloc.iovm_addr);
+		}
+	}
+	return vm;
+}
+
 /* returns a tegra_iovmm_area for a handle. if the handle already has
  * an iovmm_area allocated, the handle is simply removed from its MRU list
  * and the existing iovmm_area is returned.
@@ -107,9 +242,13 @@ struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 		BUG_ON(list_empty(&h->pgalloc.mru_list));
 		list_del(&h->pgalloc.mru_list);
 		INIT_LIST_HEAD(&h->pgalloc.mru_list);
+		h->pgalloc.reuse++;
+		c->share->mru_hits++;
 		return h->pgalloc.area;
 	}
 
+	c->share->mru_misses++;
+
 	vm = tegra_iovmm_create_vm(c->share->iovmm, NULL,
 			h->size, h->align, prot,
 			h->pgalloc.iovm_addr);
@@ -121,6 +260,10 @@ struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 	/* if client is looking for specific iovm address, return from here. */
 	if ((vm == NULL) && (h->pgalloc.iovm_addr != 0))
 		return NULL;
+
+	if (mru_policy == MRU_POLICY_FREQ)
+		return mru_evict_freq_locked(c, h, prot);
+
 	/* attempt to re-use the most recently unpinned IOVMM area in the
 	 * same size bin as the current handle. If that fails, iteratively
 	 * evict handles (starting from the current bin) until an allocation
@@ -130,13 +273,8 @@ struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 		evict = list_first_entry(mru, struct nvmap_handle,
 					 pgalloc.mru_list);
 
-	if (evict && evict->pgalloc.area->iovm_length >= h->size) {
-		list_del(&evict->pgalloc.mru_list);
-		vm = evict->pgalloc.area;
-		evict->pgalloc.area = NULL;
-		INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-		return vm;
-	}
+	if (evict && evict->pgalloc.area->iovm_length >= h->size)
+		return mru_evict_locked(c->share, evict);
 
 	idx = mru - c->share->mru_lists;
 
@@ -147,13 +285,7 @@ struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 		while (!list_empty(mru) && !vm) {
 			evict = list_first_entry(mru, struct nvmap_handle,
 						 pgalloc.mru_list);
-
-			BUG_ON(atomic_read(&evict->pin) != 0);
-			BUG_ON(!evict->pgalloc.area);
-			list_del(&evict->pgalloc.mru_list);
-			INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-			tegra_iovmm_free_vm(evict->pgalloc.area);
-			evict->pgalloc.area = NULL;
+			tegra_iovmm_free_vm(mru_evict_locked(c->share, evict));
 			vm = tegra_iovmm_create_vm(c->share->iovmm,
 					NULL, h->size, h->align,
 					prot, h->pgalloc.iovm_addr);
@@ -66,6 +66,26 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+/*
+ * The Android lowmemorykiller keeps thread group leaders on per-oom_adj
+ * lists so that it does not have to walk every process to pick a victim.
+ * lowmem_adj_add/del/replace must be called with tasklist_lock
+ * write-locked; lowmem_adj_update is called after oom_adj changes.
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_add(struct task_struct *p);
+extern void lowmem_adj_del(struct task_struct *p);
+extern void lowmem_adj_replace(struct task_struct *old,
+			       struct task_struct *new);
+extern void lowmem_adj_update(struct task_struct *p);
+#else
+static inline void lowmem_adj_add(struct task_struct *p) { }
+static inline void lowmem_adj_del(struct task_struct *p) { }
+static inline void lowmem_adj_replace(struct task_struct *old,
+				      struct task_struct *new) { }
+static inline void lowmem_adj_update(struct task_struct *p) { }
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
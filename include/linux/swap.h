@@ -263,6 +263,20 @@ extern int vm_swappiness;
 extern int remove_mapping(struct address_space *mapping, struct page *page);
 extern long vm_total_pages;
 
+/*
+ * Memory pressure levels derived from global reclaim efficiency. The level
+ * is passed as the action to vmpressure notifiers, which are called from
+ * the reclaiming context and must not sleep.
+ */
+enum vmpressure_level {
+	VMPRESSURE_LOW,
+	VMPRESSURE_MEDIUM,
+	VMPRESSURE_CRITICAL,
+	VMPRESSURE_NR_LEVELS,
+};
+extern int register_vmpressure_notifier(struct notifier_block *nb);
+extern int unregister_vmpressure_notifier(struct notifier_block *nb);
+
 #ifdef CONFIG_NUMA
 extern int zone_reclaim_mode;
 extern int sysctl_min_unmapped_ratio;
@@ -18,6 +18,7 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/atomic.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
  * states when active. If the type is set to WAKE_LOCK_SUSPEND, the wake_lock
@@ -40,13 +41,14 @@ struct wake_lock {
 	unsigned long       expires;
 #ifdef CONFIG_WAKELOCK_STAT
 	struct {
-		int             count;
-		int             expire_count;
-		int             wakeup_count;
-		ktime_t         total_time;
-		ktime_t         prevent_suspend_time;
-		ktime_t         max_time;
+		atomic_t        count;
+		atomic_t        expire_count;
+		atomic_t        wakeup_count;
+		atomic64_t      total_time;		/* ns */
+		atomic64_t      prevent_suspend_time;	/* ns */
+		atomic64_t      max_time;		/* ns */
 		ktime_t         last_time;
+		s64             sleep_wait_start;
 	} stat;
 #endif
 #endif
@@ -0,0 +1,69 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ashmem
+
+#if !defined(_TRACE_ASHMEM_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_ASHMEM_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ashmem_shrink,
+
+	TP_PROTO(unsigned long nr_to_scan,
+		unsigned long nr_purged,
+		unsigned long nr_queued,
+		u64 latency_ns),
+
+	TP_ARGS(nr_to_scan, nr_purged, nr_queued, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, nr_to_scan)
+		__field(unsigned long, nr_purged)
+		__field(unsigned long, nr_queued)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->nr_to_scan = nr_to_scan;
+		__entry->nr_purged = nr_purged;
+		__entry->nr_queued = nr_queued;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("nr_to_scan=%lu nr_purged=%lu nr_queued=%lu latency_ns=%llu",
+		__entry->nr_to_scan,
+		__entry->nr_purged,
+		__entry->nr_queued,
+		__entry->latency_ns)
+);
+
+TRACE_EVENT(ashmem_purge,
+
+	TP_PROTO(unsigned long nr_pages,
+		unsigned long nr_ranges,
+		u64 latency_ns),
+
+	TP_ARGS(nr_pages, nr_ranges, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, nr_pages)
+		__field(unsigned long, nr_ranges)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->nr_pages = nr_pages;
+		__entry->nr_ranges = nr_ranges;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("nr_pages=%lu nr_ranges=%lu latency_ns=%llu",
+		__entry->nr_pages,
+		__entry->nr_ranges,
+		__entry->latency_ns)
+);
+
+#endif /* _TRACE_ASHMEM_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -0,0 +1,217 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(binder_set_priority,
+
+	TP_PROTO(int pid,
+		unsigned int old_policy,
+		int old_prio,
+		unsigned int new_policy,
+		int new_prio),
+
+	TP_ARGS(pid, old_policy, old_prio, new_policy, new_prio),
+
+	TP_STRUCT__entry(
+		__field(int, pid)
+		__field(unsigned int, old_policy)
+		__field(int, old_prio)
+		__field(unsigned int, new_policy)
+		__field(int, new_prio)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->old_policy = old_policy;
+		__entry->old_prio = old_prio;
+		__entry->new_policy = new_policy;
+		__entry->new_prio = new_prio;
+	),
+
+	TP_printk("pid=%d policy=%u prio=%d => policy=%u prio=%d",
+		__entry->pid,
+		__entry->old_policy,
+		__entry->old_prio,
+		__entry->new_policy,
+		__entry->new_prio)
+);
+
+TRACE_EVENT(binder_transaction,
+
+	TP_PROTO(int debug_id,
+		int from_pid,
+		int from_tid,
+		int to_pid,
+		int to_tid,
+		bool reply,
+		unsigned int flags,
+		unsigned int code),
+
+	TP_ARGS(debug_id, from_pid, from_tid, to_pid, to_tid, reply, flags,
+		code),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, from_pid)
+		__field(int, from_tid)
+		__field(int, to_pid)
+		__field(int, to_tid)
+		__field(bool, reply)
+		__field(unsigned int, flags)
+		__field(unsigned int, code)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->from_pid = from_pid;
+		__entry->from_tid = from_tid;
+		__entry->to_pid = to_pid;
+		__entry->to_tid = to_tid;
+		__entry->reply = reply;
+		__entry->flags = flags;
+		__entry->code = code;
+	),
+
+	TP_printk("transaction=%d from=%d:%d to=%d:%d reply=%d flags=0x%x code=0x%x",
+		__entry->debug_id,
+		__entry->from_pid, __entry->from_tid,
+		__entry->to_pid, __entry->to_tid,
+		__entry->reply,
+		__entry->flags,
+		__entry->code)
+);
+
+TRACE_EVENT(binder_transaction_enqueue,
+
+	TP_PROTO(int debug_id,
+		int to_pid,
+		int to_tid,
+		bool async_todo),
+
+	TP_ARGS(debug_id, to_pid, to_tid, async_todo),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, to_pid)
+		__field(int, to_tid)
+		__field(bool, async_todo)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->to_pid = to_pid;
+		__entry->to_tid = to_tid;
+		__entry->async_todo = async_todo;
+	),
+
+	TP_printk("transaction=%d to=%d:%d async_todo=%d",
+		__entry->debug_id,
+		__entry->to_pid, __entry->to_tid,
+		__entry->async_todo)
+);
+
+TRACE_EVENT(binder_wakeup,
+
+	TP_PROTO(int pid,
+		int tid,
+		bool proc_work,
+		s64 slept_us),
+
+	TP_ARGS(pid, tid, proc_work, slept_us),
+
+	TP_STRUCT__entry(
+		__field(int, pid)
+		__field(int, tid)
+		__field(bool, proc_work)
+		__field(s64, slept_us)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->proc_work = proc_work;
+		__entry->slept_us = slept_us;
+	),
+
+	TP_printk("thread=%d:%d proc_work=%d slept_us=%lld",
+		__entry->pid, __entry->tid,
+		__entry->proc_work,
+		__entry->slept_us)
+);
+
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(int debug_id,
+		int pid,
+		int tid,
+		bool reply,
+		s64 queued_us),
+
+	TP_ARGS(debug_id, pid, tid, reply, queued_us),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, pid)
+		__field(int, tid)
+		__field(bool, reply)
+		__field(s64, queued_us)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->reply = reply;
+		__entry->queued_us = queued_us;
+	),
+
+	TP_printk("transaction=%d thread=%d:%d reply=%d queued_us=%lld",
+		__entry->debug_id,
+		__entry->pid, __entry->tid,
+		__entry->reply,
+		__entry->queued_us)
+);
+
+TRACE_EVENT(binder_transaction_latency,
+
+	TP_PROTO(int debug_id,
+		int from_pid,
+		int to_pid,
+		unsigned int code,
+		s64 latency_us),
+
+	TP_ARGS(debug_id, from_pid, to_pid, code, latency_us),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, from_pid)
+		__field(int, to_pid)
+		__field(unsigned int, code)
+		__field(s64, latency_us)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->from_pid = from_pid;
+		__entry->to_pid = to_pid;
+		__entry->code = code;
+		__entry->latency_us = latency_us;
+	),
+
+	TP_printk("transaction=%d from=%d to=%d code=%u latency_us=%lld",
+		__entry->debug_id,
+		__entry->from_pid,
+		__entry->to_pid,
+		__entry->code,
+		__entry->latency_us)
+);
+
+#endif /* _TRACE_BINDER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
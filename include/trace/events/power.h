@@ -168,6 +168,70 @@ TRACE_EVENT(machine_suspend,
 	TP_printk("state=%lu", (unsigned long)__entry->state)
 );
 
+TRACE_EVENT(device_pm_callback,
+
+	TP_PROTO(const char *device, int pm_event, int noirq, s64 duration_ns,
+		 int error),
+
+	TP_ARGS(device, pm_event, noirq, duration_ns, error),
+
+	TP_STRUCT__entry(
+		__string(device, device)
+		__field(int, pm_event)
+		__field(int, noirq)
+		__field(s64, duration_ns)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		__assign_str(device, device);
+		__entry->pm_event = pm_event;
+		__entry->noirq = noirq;
+		__entry->duration_ns = duration_ns;
+		__entry->error = error;
+	),
+
+	TP_printk("device=%s pm_event=%d noirq=%d duration_ns=%lld error=%d",
+		  __get_str(device), __entry->pm_event, __entry->noirq,
+		  __entry->duration_ns, __entry->error)
+);
+
+TRACE_EVENT(suspend_entry,
+
+	TP_PROTO(s64 unlock_delay_ns),
+
+	TP_ARGS(unlock_delay_ns),
+
+	TP_STRUCT__entry(
+		__field(s64, unlock_delay_ns)
+	),
+
+	TP_fast_assign(
+		__entry->unlock_delay_ns = unlock_delay_ns;
+	),
+
+	TP_printk("unlock_delay_ns=%lld", __entry->unlock_delay_ns)
+);
+
+TRACE_EVENT(suspend_abort,
+
+	TP_PROTO(const char *reason, const char *name),
+
+	TP_ARGS(reason, name),
+
+	TP_STRUCT__entry(
+		__string(reason, reason)
+		__string(name, name)
+	),
+
+	TP_fast_assign(
+		__assign_str(reason, reason);
+		__assign_str(name, name);
+	),
+
+	TP_printk("reason=%s name=%s", __get_str(reason), __get_str(name))
+);
+
 /* This code will be removed after deprecation time exceeded (2.6.41) */
 #ifdef CONFIG_EVENT_POWER_TRACING_DEPRECATED
 
@@ -21,7 +21,12 @@
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
 #include <linux/proc_fs.h>
+#include <linux/debugfs.h>
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #endif
+#include <trace/events/power.h>
 #include "power.h"
 
 enum {
@@ -38,18 +43,25 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_INITIALIZED            (1U << 8)
 #define WAKE_LOCK_ACTIVE                 (1U << 9)
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
-#define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
 static void print_active_locks(int type);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
+/*
+ * Active locks without a timeout come first, followed by those with one in
+ * order of expiry, so has_wake_lock_locked() only has to look at the ends.
+ */
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/* Number of active locks without a timeout, protected by list_lock */
+static int untimed_wake_locks[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
 suspend_state_t requested_suspend_state = PM_SUSPEND_MEM;
 static struct wake_lock unknown_wakeup;
 static struct wake_lock suspend_backoff_lock;
+/* When the last suspend lock went away, protected by list_lock */
+static ktime_t last_unlock_time;
 
 #define SUSPEND_BACKOFF_THRESHOLD	10
 #define SUSPEND_BACKOFF_INTERVAL	10000
@@ -58,9 +70,30 @@ static unsigned suspend_short_count;
 
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
-static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * Time spent waiting for suspend, i.e. with the main lock released, up to
+ * last_sleep_time_update. A suspend lock's prevent_suspend_time grows by
+ * as much as this clock while the lock is active, which spares walking the
+ * active locks every time the main lock changes state. Protected by
+ * list_lock.
+ */
+static ktime_t last_sleep_time_update;
+static s64 sleep_wait_time;
+static int sleep_waiting;
+
+/*
+ * Change of a wake lock's stats on deactivation, worked out under list_lock
+ * and added to them after it is dropped.
+ */
+struct wake_lock_stat_delta {
+	int		valid;
+	int		expired;
+	s64		duration;
+	s64		prevent_suspend_time;
+};
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -84,40 +117,51 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 }
 
 
+/* Caller must acquire the list_lock spinlock */
+static s64 sleep_wait_clock(ktime_t now)
+{
+	s64 t = sleep_wait_time;
+
+	if (sleep_waiting && now.tv64 > last_sleep_time_update.tv64)
+		t += ktime_to_ns(ktime_sub(now, last_sleep_time_update));
+	return t;
+}
+
 static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 {
-	int lock_count = lock->stat.count;
-	int expire_count = lock->stat.expire_count;
-	ktime_t active_time = ktime_set(0, 0);
-	ktime_t total_time = lock->stat.total_time;
-	ktime_t max_time = lock->stat.max_time;
+	int lock_count = atomic_read(&lock->stat.count);
+	int expire_count = atomic_read(&lock->stat.expire_count);
+	s64 active_time = 0;
+	s64 total_time = atomic64_read(&lock->stat.total_time);
+	s64 max_time = atomic64_read(&lock->stat.max_time);
+	s64 prevent_suspend_time =
+		atomic64_read(&lock->stat.prevent_suspend_time);
 
-	ktime_t prevent_suspend_time = lock->stat.prevent_suspend_time;
 	if (lock->flags & WAKE_LOCK_ACTIVE) {
-		ktime_t now, add_time;
+		ktime_t now;
+		s64 add_time;
 		int expired = get_expired_time(lock, &now);
 		if (!expired)
 			now = ktime_get();
-		add_time = ktime_sub(now, lock->stat.last_time);
+		add_time = ktime_to_ns(ktime_sub(now, lock->stat.last_time));
 		lock_count++;
 		if (!expired)
 			active_time = add_time;
 		else
 			expire_count++;
-		total_time = ktime_add(total_time, add_time);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
-			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
-		if (add_time.tv64 > max_time.tv64)
+		total_time += add_time;
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) == WAKE_LOCK_SUSPEND)
+			prevent_suspend_time += sleep_wait_clock(now) -
+				lock->stat.sleep_wait_start;
+		if (add_time > max_time)
 			max_time = add_time;
 	}
 
 	return seq_printf(m,
 		     "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",
 		     lock->name, lock_count, expire_count,
-		     lock->stat.wakeup_count, ktime_to_ns(active_time),
-		     ktime_to_ns(total_time),
-		     ktime_to_ns(prevent_suspend_time), ktime_to_ns(max_time),
+		     atomic_read(&lock->stat.wakeup_count), active_time,
+		     total_time, prevent_suspend_time, max_time,
 		     ktime_to_ns(lock->stat.last_time));
 }
 
@@ -145,56 +189,62 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
-static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
+/*
+ * Works out the change to the stats of an active lock that is being
+ * released or has expired, and restarts its timing at 'now'.
+ */
+static void wake_unlock_stat_locked(struct wake_lock *lock, int expired,
+				    ktime_t now, struct wake_lock_stat_delta *d)
 {
-	ktime_t duration;
-	ktime_t now;
+	ktime_t end;
+
+	d->valid = 0;
 	if (!(lock->flags & WAKE_LOCK_ACTIVE))
 		return;
-	if (get_expired_time(lock, &now))
+	if (get_expired_time(lock, &end))
 		expired = 1;
 	else
-		now = ktime_get();
-	lock->stat.count++;
-	if (expired)
-		lock->stat.expire_count++;
-	duration = ktime_sub(now, lock->stat.last_time);
-	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
-	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
-		lock->stat.max_time = duration;
-	lock->stat.last_time = ktime_get();
-	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
-		lock->stat.prevent_suspend_time = ktime_add(
-			lock->stat.prevent_suspend_time, duration);
-		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-	}
+		end = now;
+	d->valid = 1;
+	d->expired = expired;
+	d->duration = ktime_to_ns(ktime_sub(end, lock->stat.last_time));
+	d->prevent_suspend_time = 0;
+	if ((lock->flags & WAKE_LOCK_TYPE_MASK) == WAKE_LOCK_SUSPEND)
+		d->prevent_suspend_time = sleep_wait_clock(end) -
+			lock->stat.sleep_wait_start;
+	lock->stat.last_time = now;
+	lock->stat.sleep_wait_start = sleep_wait_clock(now);
 }
 
-static void update_sleep_wait_stats_locked(int done)
+/* Adds a delta from wake_unlock_stat_locked(), list_lock need not be held */
+static void wake_lock_stat_add(struct wake_lock *lock,
+			       struct wake_lock_stat_delta *d)
 {
-	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
-
-	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
-		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+	s64 max, old;
+
+	if (!d->valid)
+		return;
+	atomic_inc(&lock->stat.count);
+	if (d->expired)
+		atomic_inc(&lock->stat.expire_count);
+	atomic64_add(d->duration, &lock->stat.total_time);
+	atomic64_add(d->prevent_suspend_time,
+		     &lock->stat.prevent_suspend_time);
+
+	max = atomic64_read(&lock->stat.max_time);
+	while (d->duration > max) {
+		old = atomic64_cmpxchg(&lock->stat.max_time, max, d->duration);
+		if (old == max)
+			break;
+		max = old;
 	}
+}
+
+static void update_sleep_wait_stats_locked(int done, ktime_t now)
+{
+	sleep_wait_time = sleep_wait_clock(now);
 	last_sleep_time_update = now;
+	sleep_waiting = !done;
 }
 #endif
 
@@ -202,7 +252,10 @@ static void update_sleep_wait_stats_locked(int done)
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 1);
+	struct wake_lock_stat_delta d;
+
+	wake_unlock_stat_locked(lock, 1, ktime_get(), &d);
+	wake_lock_stat_add(lock, &d);
 #endif
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
@@ -234,23 +287,195 @@ static void print_active_locks(int type)
 	}
 }
 
+/*
+ * Adds an active lock with a timeout to its list, after the other locks
+ * expiring no later. New timeouts tend to expire last, so this is usually
+ * found at the first step from the tail.
+ */
+static void add_timed_lock_locked(struct wake_lock *lock, int type)
+{
+	struct wake_lock *l;
+
+	list_for_each_entry_reverse(l, &active_wake_locks[type], link) {
+		if (!(l->flags & WAKE_LOCK_AUTO_EXPIRE) ||
+		    (long)(l->expires - lock->expires) <= 0)
+			break;
+	}
+	list_add(&lock->link, &l->link);
+}
+
+/*
+ * Returns -1 if an active lock has no timeout, else the jiffies left until
+ * the last one expires, expiring those that already have. Only the expired
+ * locks and the last one are looked at.
+ */
 static long has_wake_lock_locked(int type)
 {
 	struct wake_lock *lock, *n;
-	long max_timeout = 0;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
+	if (untimed_wake_locks[type])
+		return -1;
+
 	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	if (list_empty(&active_wake_locks[type]))
+		return 0;
+
+	lock = list_entry(active_wake_locks[type].prev, struct wake_lock, link);
+	return lock->expires - jiffies;
+}
+
+enum {
+	SUSPEND_ABORT_WAKE_LOCK,	/* suspend lock held when suspend() ran */
+	SUSPEND_ABORT_LATE,		/* suspend lock taken during suspend */
+	SUSPEND_ABORT_FAILED,		/* pm_suspend() failed otherwise */
+	SUSPEND_ABORT_COUNT
+};
+
+static const char *suspend_abort_reasons[SUSPEND_ABORT_COUNT] = {
+	"wake_lock", "suspend_late", "failed"
+};
+
+#ifdef CONFIG_WAKELOCK_STAT
+#define SUSPEND_HIST_BINS	24
+#define SUSPEND_SLOW_CALLBACKS	8
+#define SUSPEND_NAME_LEN	32
+
+struct suspend_callback {
+	char		name[SUSPEND_NAME_LEN];
+	int		event;
+	int		noirq;
+	s64		duration_ns;
+};
+
+/*
+ * Suspend path statistics, shown in debugfs. The histograms have
+ * power-of-two bins; the slowest device callbacks and the device that
+ * failed are those of the last suspend attempt.
+ */
+static DEFINE_SPINLOCK(suspend_stats_lock);
+static unsigned int unlock_delay_bins[SUSPEND_HIST_BINS];	/* ms */
+static unsigned int suspend_callback_bins[SUSPEND_HIST_BINS];	/* us */
+static unsigned int resume_callback_bins[SUSPEND_HIST_BINS];	/* us */
+static struct suspend_callback slow_callbacks[SUSPEND_SLOW_CALLBACKS];
+static char failed_device[SUSPEND_NAME_LEN];
+static unsigned int abort_count[SUSPEND_ABORT_COUNT];
+static char abort_name[SUSPEND_ABORT_COUNT][SUSPEND_NAME_LEN];
+
+static int suspend_hist_bin(s64 val, u32 unit)
+{
+	u64 v = val > 0 ? val : 0;
+
+	do_div(v, unit);
+	return min(fls64(v), SUSPEND_HIST_BINS - 1);
+}
+
+/* Probe for the device_pm_callback tracepoint */
+static void suspend_stats_callback(void *data, const char *device,
+				   int event, int noirq, s64 duration_ns,
+				   int error)
+{
+	unsigned long irqflags;
+	unsigned int *bins;
+	int i, slot;
+
+	if (event == PM_EVENT_SUSPEND)
+		bins = suspend_callback_bins;
+	else if (event == PM_EVENT_RESUME)
+		bins = resume_callback_bins;
+	else
+		return;
+
+	spin_lock_irqsave(&suspend_stats_lock, irqflags);
+	bins[suspend_hist_bin(duration_ns, NSEC_PER_USEC)]++;
+	if (error)
+		strlcpy(failed_device, device, sizeof(failed_device));
+
+	slot = 0;
+	for (i = 1; i < SUSPEND_SLOW_CALLBACKS; i++)
+		if (slow_callbacks[i].duration_ns <
+		    slow_callbacks[slot].duration_ns)
+			slot = i;
+	if (duration_ns > slow_callbacks[slot].duration_ns) {
+		strlcpy(slow_callbacks[slot].name, device,
+			sizeof(slow_callbacks[slot].name));
+		slow_callbacks[slot].event = event;
+		slow_callbacks[slot].noirq = noirq;
+		slow_callbacks[slot].duration_ns = duration_ns;
+	}
+	spin_unlock_irqrestore(&suspend_stats_lock, irqflags);
+}
+#endif
+
+/*
+ * Records why a suspend attempt did not go through. A NULL name stands for
+ * the device whose callback failed.
+ */
+static void suspend_abort(int reason, const char *name)
+{
+#ifdef CONFIG_WAKELOCK_STAT
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&suspend_stats_lock, irqflags);
+	if (!name)
+		name = failed_device;
+	abort_count[reason]++;
+	strlcpy(abort_name[reason], name, sizeof(abort_name[reason]));
+	trace_suspend_abort(suspend_abort_reasons[reason], name);
+	spin_unlock_irqrestore(&suspend_stats_lock, irqflags);
+#else
+	trace_suspend_abort(suspend_abort_reasons[reason], name ? name : "");
+#endif
+}
+
+/* Called just before entering suspend, with no suspend lock held */
+static void suspend_entry(void)
+{
+	unsigned long irqflags;
+	s64 delay_ns;
+
+	spin_lock_irqsave(&list_lock, irqflags);
+	delay_ns = ktime_to_ns(ktime_sub(ktime_get(), last_unlock_time));
+	spin_unlock_irqrestore(&list_lock, irqflags);
+
+	trace_suspend_entry(delay_ns);
+#ifdef CONFIG_WAKELOCK_STAT
+	spin_lock_irqsave(&suspend_stats_lock, irqflags);
+	unlock_delay_bins[suspend_hist_bin(delay_ns, NSEC_PER_MSEC)]++;
+	memset(slow_callbacks, 0, sizeof(slow_callbacks));
+	failed_device[0] = '\0';
+	spin_unlock_irqrestore(&suspend_stats_lock, irqflags);
+#endif
+}
+
+/*
+ * Like has_wake_lock(WAKE_LOCK_SUSPEND), but records an abort blaming a
+ * lock without a timeout, or failing that the one that expires last.
+ */
+static long has_suspend_lock(int reason)
+{
+	struct list_head *head = &active_wake_locks[WAKE_LOCK_SUSPEND];
+	struct wake_lock *lock;
+	unsigned long irqflags;
+	long ret;
+
+	spin_lock_irqsave(&list_lock, irqflags);
+	ret = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
+	if (ret) {
+		if (debug_mask & DEBUG_WAKEUP)
+			print_active_locks(WAKE_LOCK_SUSPEND);
+		if (ret < 0)
+			lock = list_first_entry(head, struct wake_lock, link);
+		else
+			lock = list_entry(head->prev, struct wake_lock, link);
+		suspend_abort(reason, lock->name);
+	}
+	spin_unlock_irqrestore(&list_lock, irqflags);
+	return ret;
 }
 
 long has_wake_lock(int type)
@@ -272,13 +497,15 @@ static void suspend_backoff(void)
 			  msecs_to_jiffies(SUSPEND_BACKOFF_INTERVAL));
 }
 
+static int suspend_late_aborted;
+
 static void suspend(struct work_struct *work)
 {
 	int ret;
 	int entry_event_num;
 	struct timespec ts_entry, ts_exit;
 
-	if (has_wake_lock(WAKE_LOCK_SUSPEND)) {
+	if (has_suspend_lock(SUSPEND_ABORT_WAKE_LOCK)) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: abort suspend\n");
 		return;
@@ -288,9 +515,13 @@ static void suspend(struct work_struct *work)
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
+	suspend_entry();
+	suspend_late_aborted = 0;
 	getnstimeofday(&ts_entry);
 	ret = pm_suspend(requested_suspend_state);
 	getnstimeofday(&ts_exit);
+	if (ret && !suspend_late_aborted)
+		suspend_abort(SUSPEND_ABORT_FAILED, NULL);
 
 	if (debug_mask & DEBUG_EXIT_SUSPEND) {
 		struct rtc_time tm;
@@ -332,15 +563,19 @@ static void expire_wake_locks(unsigned long data)
 	has_lock = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
 	if (debug_mask & DEBUG_EXPIRE)
 		pr_info("expire_wake_locks: done, has_lock %ld\n", has_lock);
-	if (has_lock == 0)
+	if (has_lock == 0) {
+		last_unlock_time = ktime_get();
 		queue_work(suspend_work_queue, &suspend_work);
+	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
 
 static int power_suspend_late(struct device *dev)
 {
-	int ret = has_wake_lock(WAKE_LOCK_SUSPEND) ? -EAGAIN : 0;
+	int ret = has_suspend_lock(SUSPEND_ABORT_LATE) ? -EAGAIN : 0;
+
+	suspend_late_aborted = ret;
 #ifdef CONFIG_WAKELOCK_STAT
 	wait_for_wakeup = !ret;
 #endif
@@ -372,13 +607,14 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_init name=%s\n", lock->name);
 #ifdef CONFIG_WAKELOCK_STAT
-	lock->stat.count = 0;
-	lock->stat.expire_count = 0;
-	lock->stat.wakeup_count = 0;
-	lock->stat.total_time = ktime_set(0, 0);
-	lock->stat.prevent_suspend_time = ktime_set(0, 0);
-	lock->stat.max_time = ktime_set(0, 0);
+	atomic_set(&lock->stat.count, 0);
+	atomic_set(&lock->stat.expire_count, 0);
+	atomic_set(&lock->stat.wakeup_count, 0);
+	atomic64_set(&lock->stat.total_time, 0);
+	atomic64_set(&lock->stat.prevent_suspend_time, 0);
+	atomic64_set(&lock->stat.max_time, 0);
 	lock->stat.last_time = ktime_set(0, 0);
+	lock->stat.sleep_wait_start = 0;
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
@@ -396,19 +632,21 @@ void wake_lock_destroy(struct wake_lock *lock)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	if ((lock->flags & (WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE)) ==
+	    WAKE_LOCK_ACTIVE)
+		untimed_wake_locks[lock->flags & WAKE_LOCK_TYPE_MASK]--;
 #ifdef CONFIG_WAKELOCK_STAT
-	if (lock->stat.count) {
-		deleted_wake_locks.stat.count += lock->stat.count;
-		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
-		deleted_wake_locks.stat.total_time =
-			ktime_add(deleted_wake_locks.stat.total_time,
-				  lock->stat.total_time);
-		deleted_wake_locks.stat.prevent_suspend_time =
-			ktime_add(deleted_wake_locks.stat.prevent_suspend_time,
-				  lock->stat.prevent_suspend_time);
-		deleted_wake_locks.stat.max_time =
-			ktime_add(deleted_wake_locks.stat.max_time,
-				  lock->stat.max_time);
+	if (atomic_read(&lock->stat.count)) {
+		atomic_add(atomic_read(&lock->stat.count),
+			   &deleted_wake_locks.stat.count);
+		atomic_add(atomic_read(&lock->stat.expire_count),
+			   &deleted_wake_locks.stat.expire_count);
+		atomic64_add(atomic64_read(&lock->stat.total_time),
+			     &deleted_wake_locks.stat.total_time);
+		atomic64_add(atomic64_read(&lock->stat.prevent_suspend_time),
+			     &deleted_wake_locks.stat.prevent_suspend_time);
+		atomic64_add(atomic64_read(&lock->stat.max_time),
+			     &deleted_wake_locks.stat.max_time);
 	}
 #endif
 	list_del(&lock->link);
@@ -422,6 +660,10 @@ static void wake_lock_internal(
 	int type;
 	unsigned long irqflags;
 	long expire_in;
+#ifdef CONFIG_WAKELOCK_STAT
+	struct wake_lock_stat_delta d = { .valid = 0 };
+	ktime_t now = ktime_get();
+#endif
 
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
@@ -432,20 +674,20 @@ static void wake_lock_internal(
 		if (debug_mask & DEBUG_WAKEUP)
 			pr_info("wakeup wake lock: %s\n", lock->name);
 		wait_for_wakeup = 0;
-		lock->stat.wakeup_count++;
+		atomic_inc(&lock->stat.wakeup_count);
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
-	    (long)(lock->expires - jiffies) <= 0) {
-		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
-	}
+	    (long)(lock->expires - jiffies) <= 0)
+		wake_unlock_stat_locked(lock, 0, now, &d);
 #endif
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+		lock->stat.last_time = now;
+		lock->stat.sleep_wait_start = sleep_wait_clock(now);
 #endif
-	}
+	} else if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE))
+		untimed_wake_locks[type]--;
 	list_del(&lock->link);
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
@@ -454,21 +696,22 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		add_timed_lock_locked(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
+		untimed_wake_locks[type]++;
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
+			update_sleep_wait_stats_locked(1, now);
 		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats_locked(0, now);
 #endif
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
@@ -489,6 +732,9 @@ static void wake_lock_internal(
 		}
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	wake_lock_stat_add(lock, &d);
+#endif
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -507,13 +753,21 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
+#ifdef CONFIG_WAKELOCK_STAT
+	struct wake_lock_stat_delta d;
+	ktime_t now = ktime_get();
+#endif
+
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
+	wake_unlock_stat_locked(lock, 0, now, &d);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	if ((lock->flags & (WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE)) ==
+	    WAKE_LOCK_ACTIVE)
+		untimed_wake_locks[type]--;
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -529,18 +783,23 @@ void wake_unlock(struct wake_lock *lock)
 				if (debug_mask & DEBUG_EXPIRE)
 					pr_info("wake_unlock: %s, stop expire "
 						"timer\n", lock->name);
-			if (has_lock == 0)
+			if (has_lock == 0) {
+				last_unlock_time = ktime_get();
 				queue_work(suspend_work_queue, &suspend_work);
+			}
 		}
 		if (lock == &main_wake_lock) {
 			if (debug_mask & DEBUG_SUSPEND)
 				print_active_locks(WAKE_LOCK_SUSPEND);
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats_locked(0, now);
 #endif
 		}
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	wake_lock_stat_add(lock, &d);
+#endif
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -563,6 +822,277 @@ static const struct file_operations wakelock_stats_fops = {
 	.release = single_release,
 };
 
+#ifdef CONFIG_WAKELOCK_STAT
+static void suspend_stats_show_bins(struct seq_file *m, const char *unit,
+				    unsigned int *bins)
+{
+	int bin;
+
+	seq_printf(m, "%10s %10s %10s\n", unit, "", "count");
+	for (bin = 0; bin < SUSPEND_HIST_BINS; bin++) {
+		if (!bins[bin])
+			continue;
+		if (bin == SUSPEND_HIST_BINS - 1)
+			seq_printf(m, "%10u %10s %10u\n",
+				   1U << (bin - 1), "-", bins[bin]);
+		else
+			seq_printf(m, "%10u %10u %10u\n",
+				   bin ? 1U << (bin - 1) : 0, 1U << bin,
+				   bins[bin]);
+	}
+}
+
+static int suspend_stats_show(struct seq_file *m, void *unused)
+{
+	unsigned long irqflags;
+	int i;
+
+	spin_lock_irqsave(&suspend_stats_lock, irqflags);
+	seq_puts(m, "last wake_unlock to suspend entry\n");
+	suspend_stats_show_bins(m, "ms", unlock_delay_bins);
+	seq_puts(m, "\ndevice suspend callbacks\n");
+	suspend_stats_show_bins(m, "us", suspend_callback_bins);
+	seq_puts(m, "\ndevice resume callbacks\n");
+	suspend_stats_show_bins(m, "us", resume_callback_bins);
+
+	seq_puts(m, "\nslowest callbacks of the last attempt\n");
+	for (i = 0; i < SUSPEND_SLOW_CALLBACKS; i++) {
+		struct suspend_callback *cb = &slow_callbacks[i];
+
+		if (!cb->duration_ns)
+			continue;
+		seq_printf(m, "%-32s %s%s %lld us\n", cb->name,
+			   cb->event == PM_EVENT_SUSPEND ? "suspend" : "resume",
+			   cb->noirq ? "_noirq" : "",
+			   div_s64(cb->duration_ns, NSEC_PER_USEC));
+	}
+	if (failed_device[0])
+		seq_printf(m, "failed device: %s\n", failed_device);
+
+	seq_puts(m, "\naborts\n");
+	for (i = 0; i < SUSPEND_ABORT_COUNT; i++)
+		seq_printf(m, "%-12s %10u  last: %s\n",
+			   suspend_abort_reasons[i], abort_count[i],
+			   abort_name[i]);
+	spin_unlock_irqrestore(&suspend_stats_lock, irqflags);
+	return 0;
+}
+
+static int suspend_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, suspend_stats_show, NULL);
+}
+
+static const struct file_operations suspend_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = suspend_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Lock/unlock throughput benchmark.  Writing "<locks> <ms>" to wakelock_bench
+ * in debugfs holds <locks> suspend locks with staggered timeouts, then has
+ * every online CPU take and drop a lock of its own for <ms> milliseconds.
+ * Reading the file shows the result of the last run.  At least one lock is
+ * held so that the benchmark itself never lets the system suspend.
+ */
+#define WAKELOCK_BENCH_MAX_LOCKS	1024
+#define WAKELOCK_BENCH_MAX_MS		10000
+
+struct wakelock_bench_cpu {
+	struct wake_lock lock;
+	struct completion done;
+	unsigned long end;
+	unsigned long ops;
+	s64 elapsed_ns;
+};
+
+static DEFINE_MUTEX(wakelock_bench_mutex);
+static unsigned int wakelock_bench_locks;
+static unsigned int wakelock_bench_ms;
+static unsigned long wakelock_bench_ops[NR_CPUS];
+static s64 wakelock_bench_ns[NR_CPUS];
+static cpumask_t wakelock_bench_cpus;
+
+static int wakelock_bench_thread(void *data)
+{
+	struct wakelock_bench_cpu *bc = data;
+	ktime_t start = ktime_get();
+
+	while (time_before(jiffies, bc->end)) {
+		wake_lock(&bc->lock);
+		wake_unlock(&bc->lock);
+		bc->ops++;
+		cond_resched();
+	}
+	bc->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	complete(&bc->done);
+	return 0;
+}
+
+static int wakelock_bench_run(unsigned int nr_locks, unsigned int ms)
+{
+	struct wakelock_bench_cpu *bc;
+	struct task_struct *tasks[NR_CPUS];
+	struct wake_lock *held;
+	unsigned long end;
+	cpumask_t cpus;
+	int cpu, i;
+	int ret = 0;
+
+	held = kcalloc(nr_locks, sizeof(*held), GFP_KERNEL);
+	bc = kcalloc(NR_CPUS, sizeof(*bc), GFP_KERNEL);
+	if (!held || !bc) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < nr_locks; i++) {
+		wake_lock_init(&held[i], WAKE_LOCK_SUSPEND,
+			       "wakelock_bench_held");
+		wake_lock_timeout(&held[i], msecs_to_jiffies(ms) + HZ + i);
+	}
+
+	get_online_cpus();
+	cpumask_clear(&cpus);
+	for_each_online_cpu(cpu) {
+		wake_lock_init(&bc[cpu].lock, WAKE_LOCK_SUSPEND,
+			       "wakelock_bench");
+		init_completion(&bc[cpu].done);
+		tasks[cpu] = kthread_create(wakelock_bench_thread, &bc[cpu],
+					    "wakelock_bench/%d", cpu);
+		if (IS_ERR(tasks[cpu])) {
+			ret = PTR_ERR(tasks[cpu]);
+			wake_lock_destroy(&bc[cpu].lock);
+			break;
+		}
+		kthread_bind(tasks[cpu], cpu);
+		cpumask_set_cpu(cpu, &cpus);
+	}
+
+	if (ret) {
+		/* never woken, so these exit without running the loop */
+		for_each_cpu(cpu, &cpus) {
+			kthread_stop(tasks[cpu]);
+			wake_lock_destroy(&bc[cpu].lock);
+		}
+		put_online_cpus();
+		goto out_unlock;
+	}
+
+	end = jiffies + msecs_to_jiffies(ms);
+	for_each_cpu(cpu, &cpus) {
+		bc[cpu].end = end;
+		wake_up_process(tasks[cpu]);
+	}
+	for_each_cpu(cpu, &cpus) {
+		wait_for_completion(&bc[cpu].done);
+		wake_lock_destroy(&bc[cpu].lock);
+	}
+	put_online_cpus();
+
+	wakelock_bench_locks = nr_locks;
+	wakelock_bench_ms = ms;
+	cpumask_copy(&wakelock_bench_cpus, &cpus);
+	for_each_cpu(cpu, &cpus) {
+		wakelock_bench_ops[cpu] = bc[cpu].ops;
+		wakelock_bench_ns[cpu] = bc[cpu].elapsed_ns;
+	}
+
+out_unlock:
+	for (i = 0; i < nr_locks; i++) {
+		wake_unlock(&held[i]);
+		wake_lock_destroy(&held[i]);
+	}
+out_free:
+	kfree(bc);
+	kfree(held);
+	return ret;
+}
+
+static int wakelock_bench_show(struct seq_file *m, void *unused)
+{
+	u64 total = 0;
+	int cpu;
+
+	mutex_lock(&wakelock_bench_mutex);
+	if (!wakelock_bench_ms) {
+		seq_puts(m, "write \"<locks> <ms>\" to run\n");
+		goto out;
+	}
+	seq_printf(m, "%u locks held, %u ms\n", wakelock_bench_locks,
+		   wakelock_bench_ms);
+	for_each_cpu(cpu, &wakelock_bench_cpus) {
+		u64 rate = 0;
+
+		if (wakelock_bench_ns[cpu] > 0)
+			rate = div64_u64((u64)wakelock_bench_ops[cpu] *
+					 NSEC_PER_SEC,
+					 wakelock_bench_ns[cpu]);
+		total += rate;
+		seq_printf(m, "cpu%d %10lu ops %10llu ops/sec\n", cpu,
+			   wakelock_bench_ops[cpu], rate);
+	}
+	seq_printf(m, "total %25llu ops/sec\n", total);
+out:
+	mutex_unlock(&wakelock_bench_mutex);
+	return 0;
+}
+
+static ssize_t wakelock_bench_write(struct file *file,
+				    const char __user *user_buf,
+				    size_t count, loff_t *ppos)
+{
+	unsigned int nr_locks, ms;
+	char buf[32];
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, user_buf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%u %u", &nr_locks, &ms) != 2 || !nr_locks ||
+	    nr_locks > WAKELOCK_BENCH_MAX_LOCKS || !ms ||
+	    ms > WAKELOCK_BENCH_MAX_MS)
+		return -EINVAL;
+
+	mutex_lock(&wakelock_bench_mutex);
+	ret = wakelock_bench_run(nr_locks, ms);
+	mutex_unlock(&wakelock_bench_mutex);
+	return ret ? ret : count;
+}
+
+static int wakelock_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wakelock_bench_show, NULL);
+}
+
+static const struct file_operations wakelock_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelock_bench_open,
+	.read = seq_read,
+	.write = wakelock_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* debugfs is not up yet when wakelocks_init() runs */
+static int __init suspend_stats_init(void)
+{
+	register_trace_device_pm_callback(suspend_stats_callback, NULL);
+	debugfs_create_file("suspend_stats", S_IRUGO, NULL, NULL,
+			    &suspend_stats_fops);
+	debugfs_create_file("wakelock_bench", S_IRUGO | S_IWUSR, NULL, NULL,
+			    &wakelock_bench_fops);
+	return 0;
+}
+late_initcall(suspend_stats_init);
+#endif
+
 static int __init wakelocks_init(void)
 {
 	int ret;
@@ -1972,6 +1972,96 @@ static inline bool should_continue_reclaim(struct zone *zone,
 	}
 }
 
+/*
+ * Reclaim efficiency based memory pressure.  Pages scanned and reclaimed by
+ * global reclaim are accumulated over a window of VMPRESSURE_WIN scanned
+ * pages.  At the end of each window the share of scanned pages that could
+ * not be reclaimed is mapped to a level and handed to the vmpressure
+ * notifiers, so userspace can be told to trim before the lowmemorykiller
+ * or the OOM killer have to step in.
+ */
+#define VMPRESSURE_WIN			(SWAP_CLUSTER_MAX * 16)
+#define VMPRESSURE_MEDIUM_PCT		60
+#define VMPRESSURE_CRITICAL_PCT		95
+/* Reclaim priority at which we are scanning 1/8th of the LRUs at once */
+#define VMPRESSURE_CRITICAL_PRIO	3
+
+static ATOMIC_NOTIFIER_HEAD(vmpressure_notifier);
+static DEFINE_SPINLOCK(vmpressure_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+
+int register_vmpressure_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(register_vmpressure_notifier);
+
+int unregister_vmpressure_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_vmpressure_notifier);
+
+static bool vmpressure_tracked(struct scan_control *sc)
+{
+	if (!scanning_global_lru(sc))
+		return false;
+	/*
+	 * Allocations that can neither enter the filesystem, do IO nor use
+	 * highmem/movable zones say little about overall memory pressure.
+	 */
+	return sc->gfp_mask & (__GFP_HIGHMEM | __GFP_MOVABLE |
+			       __GFP_IO | __GFP_FS);
+}
+
+static void vmpressure(struct scan_control *sc, unsigned long scanned,
+		       unsigned long reclaimed)
+{
+	unsigned long pressure;
+	enum vmpressure_level level;
+
+	if (!scanned || !vmpressure_tracked(sc))
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	if (vmpressure_scanned < VMPRESSURE_WIN) {
+		spin_unlock(&vmpressure_lock);
+		return;
+	}
+	scanned = vmpressure_scanned;
+	reclaimed = vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	pressure = 0;
+	if (reclaimed < scanned)
+		pressure = (scanned - reclaimed) * 100 / scanned;
+
+	if (pressure >= VMPRESSURE_CRITICAL_PCT)
+		level = VMPRESSURE_CRITICAL;
+	else if (pressure >= VMPRESSURE_MEDIUM_PCT)
+		level = VMPRESSURE_MEDIUM;
+	else
+		level = VMPRESSURE_LOW;
+	atomic_notifier_call_chain(&vmpressure_notifier, level, NULL);
+}
+
+/*
+ * Reclaim that has to dig this deep is critical no matter what the
+ * efficiency of the last window was.
+ */
+static void vmpressure_prio(struct scan_control *sc, int priority)
+{
+	if (priority > VMPRESSURE_CRITICAL_PRIO || !vmpressure_tracked(sc))
+		return;
+	atomic_notifier_call_chain(&vmpressure_notifier,
+				   VMPRESSURE_CRITICAL, NULL);
+}
+
 /*
  * This is a basic per-zone page freer.  Used by both kswapd and direct reclaim.
  */
@@ -2013,6 +2103,7 @@ restart:
 			break;
 	}
 	sc->nr_reclaimed += nr_reclaimed;
+	vmpressure(sc, sc->nr_scanned - nr_scanned, nr_reclaimed);
 
 	/*
 	 * Even if we did not try to evict anon pages at all, we want to
@@ -2148,6 +2239,7 @@ static unsigned long do_try_to_free_pages(struct zonelist *zonelist,
 		if (!priority)
 			disable_swap_token(sc->mem_cgroup);
 		shrink_zones(priority, zonelist, sc);
+		vmpressure_prio(sc, priority);
 		/*
 		 * Don't shrink slabs when reclaiming memory from
 		 * over limit cgroups
@@ -0,0 +1,2 @@
+#ifndef ASM_CPUTIME_H
+#endif
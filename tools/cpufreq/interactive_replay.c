@@ -0,0 +1,457 @@
+/*
+ * interactive_replay - replay load traces through the interactive governor
+ *
+ * Builds drivers/cpufreq/cpufreq_interactive.c in userspace and drives it on
+ * a simulated two-CPU machine with a shared clock, in 1ms steps, so that
+ * tunables can be compared for responsiveness and energy on the same trace.
+ *
+ * A trace is a text file with one event per line, times in milliseconds:
+ *
+ *	<ms> load <cpu> <khz>	cpu now needs khz worth of cycles
+ *	<ms> input		an input event (touch or key)
+ *	<ms> end		stop the replay
+ *
+ * Blank lines and lines starting with '#' are skipped.  Work a CPU cannot
+ * run at the current speed is queued and delays everything after it; a CPU
+ * that empties its queue idles for the rest of the millisecond, and the
+ * governor sees that through its idle notifier.
+ *
+ * Tunables are set through the governor's own sysfs store functions with
+ * -p name=value, e.g. -p input_boost_freq=1000000 -p target_loads="85 1000000:95".
+ */
+
+#define _GNU_SOURCE
+#include "interactive_shim.h"
+#include "cpufreq_interactive.c"
+
+#include <getopt.h>
+
+unsigned long jiffies;
+u64 sim_now_us;
+unsigned int sim_cpu;
+struct kobject *cpufreq_global_kobject;
+
+#define MAX_FREQS	32
+
+/* shared clock, in kHz, and its voltage in mV */
+static struct cpufreq_frequency_table freq_table[MAX_FREQS + 1];
+static unsigned int freq_mv[MAX_FREQS];
+static unsigned int nr_freqs;
+
+static const char default_table[] =
+	"216000:750,312000:775,456000:800,608000:850,760000:900,"
+	"816000:925,912000:975,1000000:1000,1200000:1100,1300000:1150";
+
+static cpumask_t policy_cpus;
+static struct cpufreq_policy policy;
+static struct notifier_block *idle_nb;
+static struct task_struct up_thread;
+
+struct sim_cpu {
+	unsigned int demand;	/* kHz, i.e. cycles per ms */
+	double backlog;		/* cycles queued */
+	u64 idle_us;
+	int idle;
+};
+
+static struct sim_cpu cpus[NR_CPUS];
+
+/* statistics */
+static double energy_mj;
+static double work_total, work_delay;	/* cycles, cycle-ms */
+static u64 time_at_freq[MAX_FREQS];
+static unsigned long nr_changes;
+static unsigned long nr_inputs;
+static u64 ramp_sum, ramp_max;
+static u64 ramp_start;
+static int ramp_pending;
+
+u64 get_cpu_idle_time_us(int cpu, u64 *wall)
+{
+	if (wall)
+		*wall = sim_now_us;
+	return cpus[cpu].idle_us;
+}
+
+u64 get_cpu_iowait_time_us(int cpu, u64 *wall)
+{
+	if (wall)
+		*wall = sim_now_us;
+	return 0;
+}
+
+void smp_call_function_single(int cpu, void (*func)(void *info), void *info,
+			      int wait)
+{
+	unsigned int prev = sim_cpu;
+
+	sim_cpu = cpu;
+	func(info);
+	sim_cpu = prev;
+}
+
+struct task_struct *kthread_create(int (*fn)(void *data), void *data,
+				   const char *name)
+{
+	up_thread.fn = fn;
+	return &up_thread;
+}
+
+void idle_notifier_register(struct notifier_block *nb)
+{
+	idle_nb = nb;
+}
+
+struct cpufreq_frequency_table *cpufreq_frequency_get_table(unsigned int cpu)
+{
+	return freq_table;
+}
+
+int cpufreq_frequency_table_target(struct cpufreq_policy *policy,
+				   struct cpufreq_frequency_table *table,
+				   unsigned int target_freq,
+				   unsigned int relation, unsigned int *index)
+{
+	int best = -1;
+	unsigned int i;
+
+	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
+		unsigned int f = table[i].frequency;
+
+		if (f < policy->min || f > policy->max)
+			continue;
+		if (relation == CPUFREQ_RELATION_H) {
+			/* highest at or below target, else the lowest */
+			if (f <= target_freq &&
+			    (best < 0 || f > table[best].frequency ||
+			     table[best].frequency > target_freq))
+				best = i;
+			else if (best < 0 || (table[best].frequency >
+					      target_freq &&
+					      f < table[best].frequency))
+				best = i;
+		} else {
+			/* lowest at or above target, else the highest */
+			if (f >= target_freq &&
+			    (best < 0 || f < table[best].frequency ||
+			     table[best].frequency < target_freq))
+				best = i;
+			else if (best < 0 || (table[best].frequency <
+					      target_freq &&
+					      f > table[best].frequency))
+				best = i;
+		}
+	}
+	if (best < 0)
+		return -EINVAL;
+	*index = best;
+	return 0;
+}
+
+int __cpufreq_driver_target(struct cpufreq_policy *policy,
+			    unsigned int target_freq, unsigned int relation)
+{
+	unsigned int index;
+
+	if (cpufreq_frequency_table_target(policy, freq_table, target_freq,
+					   relation, &index))
+		return -EINVAL;
+	if (policy->cur != freq_table[index].frequency)
+		nr_changes++;
+	policy->cur = freq_table[index].frequency;
+	return 0;
+}
+
+static unsigned int freq_index(unsigned int freq)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_freqs; i++)
+		if (freq_table[i].frequency == freq)
+			break;
+	return i;
+}
+
+static void parse_table(const char *s)
+{
+	nr_freqs = 0;
+	while (*s && nr_freqs < MAX_FREQS) {
+		unsigned int khz, mv;
+		int n;
+
+		if (sscanf(s, "%u:%u%n", &khz, &mv, &n) != 2) {
+			fprintf(stderr, "bad frequency table at \"%s\"\n", s);
+			exit(2);
+		}
+		freq_table[nr_freqs].index = nr_freqs;
+		freq_table[nr_freqs].frequency = khz;
+		freq_mv[nr_freqs] = mv;
+		nr_freqs++;
+		s += n;
+		if (*s == ',')
+			s++;
+	}
+	freq_table[nr_freqs].frequency = CPUFREQ_TABLE_END;
+}
+
+static void set_tunable(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	struct attribute **attr;
+
+	if (!eq) {
+		fprintf(stderr, "expected name=value, got \"%s\"\n", arg);
+		exit(2);
+	}
+	for (attr = interactive_attributes; *attr; attr++) {
+		struct global_attr *ga =
+			(struct global_attr *)((char *)*attr -
+				offsetof(struct global_attr, attr));
+
+		if (strncmp((*attr)->name, arg, eq - arg) ||
+		    (*attr)->name[eq - arg])
+			continue;
+		if (ga->store(NULL, *attr, eq + 1, strlen(eq + 1)) < 0) {
+			fprintf(stderr, "bad value for %s\n", (*attr)->name);
+			exit(2);
+		}
+		return;
+	}
+	fprintf(stderr, "no tunable \"%.*s\"\n", (int)(eq - arg), arg);
+	exit(2);
+}
+
+/* runs whatever the governor handed to up_task and the down work */
+static void run_deferred(void)
+{
+	if (up_thread.woken) {
+		up_thread.woken = 0;
+		up_thread.fn(NULL);
+	}
+	if (freq_scale_down_work.pending) {
+		freq_scale_down_work.pending = 0;
+		freq_scale_down_work.func(&freq_scale_down_work);
+	}
+}
+
+static void fire_timers(void)
+{
+	unsigned int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		struct timer_list *t = &per_cpu(cpuinfo, cpu).cpu_timer;
+
+		if (!t->pending || time_before(jiffies, t->expires))
+			continue;
+		t->pending = 0;
+		sim_cpu = cpu;
+		t->function(t->data);
+	}
+}
+
+/* the speed the current demand needs, capped at the policy maximum */
+static unsigned int needed_freq(void)
+{
+	unsigned int cpu, need = 0;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		need = max(need, cpus[cpu].demand);
+	return min(need, policy.max);
+}
+
+static void set_idle(unsigned int cpu, int idle)
+{
+	cpus[cpu].idle = idle;
+	sim_cpu = cpu;
+	idle_nb->notifier_call(idle_nb, idle ? IDLE_START : IDLE_END, NULL);
+}
+
+static void step_1ms(void)
+{
+	unsigned int idx = freq_index(policy.cur);
+	double volt = freq_mv[idx] / 1000.0;
+	unsigned int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		struct sim_cpu *c = &cpus[cpu];
+		double cap = policy.cur;
+		double served;
+
+		c->backlog += c->demand;
+		if (c->backlog && c->idle)
+			set_idle(cpu, 0);
+
+		work_total += c->demand;
+		served = min(c->backlog, cap);
+		c->backlog -= served;
+		work_delay += c->backlog;
+
+		c->idle_us += (u64)(1000 * (1 - served / cap));
+
+		/* mW over 1ms: 0.4nF switched plus leakage while running,
+		 * 5mW while in WFI */
+		energy_mj += (served / cap *
+			      (0.4e-9 * volt * volt * policy.cur * 1e6 +
+			       30 * volt) +
+			      (1 - served / cap) * 5) / 1000;
+
+		/* done with its queue for now: idle out the rest of the ms */
+		if (!c->backlog && !c->idle)
+			set_idle(cpu, 1);
+	}
+
+	time_at_freq[idx]++;
+	if (ramp_pending && policy.cur >= needed_freq()) {
+		u64 ramp = sim_now_us - ramp_start;
+
+		ramp_sum += ramp;
+		ramp_max = max(ramp_max, ramp);
+		ramp_pending = 0;
+	}
+
+	sim_now_us += 1000;
+	if (!(sim_now_us % (1000000 / HZ))) {
+		jiffies++;
+		fire_timers();
+	}
+	run_deferred();
+}
+
+static void input(void)
+{
+	nr_inputs++;
+	if (!ramp_pending) {
+		ramp_start = sim_now_us;
+		ramp_pending = 1;
+	}
+	sim_cpu = 0;
+	cpufreq_interactive_input_handler.event(NULL, EV_ABS,
+						ABS_MT_POSITION_X, 0);
+	run_deferred();
+}
+
+static int replay(FILE *f)
+{
+	char line[256];
+	unsigned int lineno = 0;
+	unsigned long ms = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long at;
+		unsigned int cpu, khz;
+		char cmd[16];
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%lu %15s", &at, cmd) != 2 || at < ms) {
+			fprintf(stderr, "line %u: bad event\n", lineno);
+			return -1;
+		}
+		for (; ms < at; ms++)
+			step_1ms();
+
+		if (!strcmp(cmd, "end")) {
+			break;
+		} else if (!strcmp(cmd, "input")) {
+			input();
+		} else if (!strcmp(cmd, "load") &&
+			   sscanf(line, "%*u %*s %u %u", &cpu, &khz) == 2 &&
+			   cpu < NR_CPUS) {
+			cpus[cpu].demand = khz;
+		} else {
+			fprintf(stderr, "line %u: bad event\n", lineno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void report(void)
+{
+	u64 total_ms = sim_now_us / 1000;
+	unsigned int i;
+
+	printf("replayed %llu ms, %lu speed changes, %lu input events\n",
+	       (unsigned long long)total_ms, nr_changes, nr_inputs);
+	printf("energy: %.1f mJ (%.1f mW average)\n", energy_mj,
+	       total_ms ? energy_mj / total_ms * 1000 : 0);
+	printf("work delay: %.2f ms average per cycle\n",
+	       work_total ? work_delay / work_total : 0);
+	if (nr_inputs)
+		printf("input ramp: %.1f ms average, %.1f ms max "
+		       "(input to the speed the load needs)\n",
+		       (double)ramp_sum / 1000 / nr_inputs,
+		       (double)ramp_max / 1000);
+	for (i = 0; i < nr_freqs; i++)
+		if (time_at_freq[i])
+			printf("  %8u kHz: %5.1f%%\n", freq_table[i].frequency,
+			       100.0 * time_at_freq[i] / total_ms);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-F khz:mV,...] [-p tunable=value]... [trace]\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *table = default_table;
+	FILE *f = stdin;
+	char **tunables;
+	int nr_tunables = 0;
+	unsigned int cpu;
+	int opt;
+
+	/* tunables are applied once the governor has set its defaults */
+	tunables = calloc(argc, sizeof(*tunables));
+	if (!tunables)
+		return 1;
+
+	while ((opt = getopt(argc, argv, "F:p:")) != -1) {
+		switch (opt) {
+		case 'F':
+			table = optarg;
+			break;
+		case 'p':
+			tunables[nr_tunables++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc) {
+		f = fopen(argv[optind], "r");
+		if (!f) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	parse_table(table);
+	if (!nr_freqs)
+		usage(argv[0]);
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		cpumask_set_cpu(cpu, &policy_cpus);
+		cpus[cpu].idle = 1;
+	}
+	policy.cpus = &policy_cpus;
+	policy.min = freq_table[0].frequency;
+	policy.max = freq_table[nr_freqs - 1].frequency;
+	policy.cur = policy.min;
+
+	if (cpufreq_interactive_init())
+		return 1;
+	while (nr_tunables--)
+		set_tunable(tunables[nr_tunables]);
+	cpufreq_governor_interactive(&policy, CPUFREQ_GOV_START);
+
+	if (replay(f))
+		return 1;
+	report();
+	return 0;
+}
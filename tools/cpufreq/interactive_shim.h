@@ -0,0 +1,376 @@
+#ifndef INTERACTIVE_SHIM_H
+#define INTERACTIVE_SHIM_H
+
+/*
+ * Just enough of the kernel for drivers/cpufreq/cpufreq_interactive.c to
+ * build and run in userspace on a simulated clock.  Time, idle accounting,
+ * timers, the up task and the down work are all driven by the replay loop
+ * in interactive_replay.c; there is no concurrency.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <linux/input-event-codes.h>
+
+typedef uint64_t u64;
+typedef u64 cputime64_t;
+typedef struct { int counter; } atomic_t;
+typedef struct { int64_t tv64; } ktime_t;
+
+#define NR_CPUS		2
+#define HZ		100
+#define MAX_RT_PRIO	100
+#define SCHED_FIFO	1
+#define GFP_KERNEL	0
+#define THIS_MODULE	NULL
+
+#define __init
+#define __exit
+#define module_init(fn)
+#define module_exit(fn)
+#define fs_initcall(fn)
+#define MODULE_AUTHOR(s)
+#define MODULE_DESCRIPTION(s)
+#define MODULE_LICENSE(s)
+
+#define ATOMIC_INIT(i)	{ (i) }
+#define BITS_PER_LONG	(8 * (int)sizeof(long))
+#define BIT_MASK(nr)	(1UL << ((nr) % BITS_PER_LONG))
+#define BIT_WORD(nr)	((nr) / BITS_PER_LONG)
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+#define min(x, y)	((x) < (y) ? (x) : (y))
+#define max(x, y)	((x) > (y) ? (x) : (y))
+#define IS_ERR(ptr)	((unsigned long)(ptr) >= (unsigned long)-4095)
+#define PTR_ERR(ptr)	((long)(ptr))
+
+#define pr_warn(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_warn_once(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define smp_rmb()	do { } while (0)
+#define smp_wmb()	do { } while (0)
+
+static inline int atomic_inc_return(atomic_t *v)
+{
+	return ++v->counter;
+}
+
+static inline int atomic_dec_return(atomic_t *v)
+{
+	return --v->counter;
+}
+
+static inline int strict_strtoul(const char *cp, unsigned int base,
+				 unsigned long *res)
+{
+	char *end;
+
+	*res = strtoul(cp, &end, base);
+	if (end == cp || (*end && *end != '\n'))
+		return -EINVAL;
+	return 0;
+}
+
+#define kmalloc(size, gfp)	malloc(size)
+#define kzalloc(size, gfp)	calloc(1, size)
+#define kfree(p)		free(p)
+
+/* the simulated machine, owned by interactive_replay.c */
+extern unsigned long jiffies;
+extern u64 sim_now_us;
+extern unsigned int sim_cpu;
+
+u64 get_cpu_idle_time_us(int cpu, u64 *wall);
+u64 get_cpu_iowait_time_us(int cpu, u64 *wall);
+
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define cputime64_sub(a, b)	((a) - (b))
+
+static inline unsigned long usecs_to_jiffies(unsigned long us)
+{
+	return (us + 1000000 / HZ - 1) / (1000000 / HZ);
+}
+
+static inline ktime_t ktime_get(void)
+{
+	ktime_t t = { .tv64 = sim_now_us * 1000 };
+
+	return t;
+}
+
+#define ktime_to_us(kt)	((kt).tv64 / 1000)
+
+/* locking: nothing runs concurrently */
+typedef struct { int dummy; } spinlock_t;
+struct mutex { int dummy; };
+
+#define DEFINE_SPINLOCK(x)		spinlock_t x
+#define spin_lock_init(l)		do { } while (0)
+#define spin_lock_irqsave(l, f)		((void)(f))
+#define spin_unlock_irqrestore(l, f)	((void)(f))
+#define mutex_init(m)			do { } while (0)
+#define mutex_lock(m)			do { } while (0)
+#define mutex_unlock(m)			do { } while (0)
+
+/* cpus and per-cpu data */
+typedef struct { unsigned long bits[BITS_TO_LONGS(NR_CPUS)]; } cpumask_t;
+
+#define DEFINE_PER_CPU(type, name)	type name[NR_CPUS]
+#define per_cpu(var, cpu)		((var)[cpu])
+#define smp_processor_id()		sim_cpu
+
+static inline void cpumask_set_cpu(unsigned int cpu, cpumask_t *mask)
+{
+	mask->bits[BIT_WORD(cpu)] |= BIT_MASK(cpu);
+}
+
+static inline void cpumask_clear(cpumask_t *mask)
+{
+	memset(mask, 0, sizeof(*mask));
+}
+
+static inline int cpumask_test_cpu(unsigned int cpu, const cpumask_t *mask)
+{
+	return !!(mask->bits[BIT_WORD(cpu)] & BIT_MASK(cpu));
+}
+
+static inline int cpumask_empty(const cpumask_t *mask)
+{
+	unsigned int i;
+
+	for (i = 0; i < BITS_TO_LONGS(NR_CPUS); i++)
+		if (mask->bits[i])
+			return 0;
+	return 1;
+}
+
+#define for_each_cpu(cpu, mask) \
+	for ((cpu) = 0; (cpu) < NR_CPUS; (cpu)++) \
+		if (cpumask_test_cpu((cpu), (mask)))
+#define for_each_online_cpu(cpu)	for ((cpu) = 0; (cpu) < NR_CPUS; (cpu)++)
+#define for_each_possible_cpu(cpu)	for_each_online_cpu(cpu)
+#define cpu_online(cpu)			((cpu) < NR_CPUS)
+
+void smp_call_function_single(int cpu, void (*func)(void *info), void *info,
+			      int wait);
+
+/* timers */
+struct timer_list {
+	unsigned long expires;
+	void (*function)(unsigned long data);
+	unsigned long data;
+	int pending;
+};
+
+#define init_timer(t)		((t)->pending = 0)
+#define timer_pending(t)	((t)->pending)
+
+static inline int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	int was_pending = timer->pending;
+
+	timer->expires = expires;
+	timer->pending = 1;
+	return was_pending;
+}
+
+static inline int del_timer(struct timer_list *timer)
+{
+	int was_pending = timer->pending;
+
+	timer->pending = 0;
+	return was_pending;
+}
+
+#define del_timer_sync(t)	del_timer(t)
+
+/* the up task and the down work run when the replay loop gets to them */
+struct task_struct {
+	int (*fn)(void *data);
+	int woken;
+};
+
+struct sched_param {
+	int sched_priority;
+};
+
+struct work_struct {
+	void (*func)(struct work_struct *work);
+	int pending;
+};
+
+struct workqueue_struct {
+	int dummy;
+};
+
+struct task_struct *kthread_create(int (*fn)(void *data), void *data,
+				   const char *name);
+#define kthread_should_stop()	1	/* only asked once idle: return */
+
+static inline int kthread_stop(struct task_struct *t)
+{
+	return 0;
+}
+
+#define set_current_state(s)	do { } while (0)
+#define schedule()		do { } while (0)
+#define get_task_struct(t)	do { } while (0)
+#define put_task_struct(t)	do { } while (0)
+
+static inline int sched_setscheduler_nocheck(struct task_struct *t,
+					     int policy,
+					     const struct sched_param *param)
+{
+	return 0;
+}
+
+static inline int wake_up_process(struct task_struct *t)
+{
+	t->woken = 1;
+	return 1;
+}
+
+#define INIT_WORK(w, f)		((w)->func = (f), (w)->pending = 0)
+#define alloc_workqueue(name, flags, max)	\
+	((struct workqueue_struct *)calloc(1, sizeof(struct workqueue_struct)))
+#define destroy_workqueue(wq)	free(wq)
+#define flush_work(w)		do { } while (0)
+
+static inline int queue_work(struct workqueue_struct *wq,
+			     struct work_struct *work)
+{
+	int was_pending = work->pending;
+
+	work->pending = 1;
+	return !was_pending;
+}
+
+/* idle notifier */
+#define IDLE_START	1
+#define IDLE_END	2
+
+struct notifier_block {
+	int (*notifier_call)(struct notifier_block *nb, unsigned long val,
+			     void *data);
+};
+
+void idle_notifier_register(struct notifier_block *nb);
+
+/* sysfs */
+struct kobject {
+	int dummy;
+};
+
+struct attribute {
+	const char *name;
+	mode_t mode;
+};
+
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+};
+
+struct global_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct kobject *kobj, struct attribute *attr,
+			char *buf);
+	ssize_t (*store)(struct kobject *kobj, struct attribute *attr,
+			 const char *buf, size_t count);
+};
+
+#define __ATTR(_name, _mode, _show, _store) { \
+	.attr = { .name = #_name, .mode = _mode }, \
+	.show = _show, \
+	.store = _store, \
+}
+
+extern struct kobject *cpufreq_global_kobject;
+#define sysfs_create_group(kobj, grp)	0
+#define sysfs_remove_group(kobj, grp)	do { } while (0)
+
+/* cpufreq */
+#define CPUFREQ_RELATION_L	0
+#define CPUFREQ_RELATION_H	1
+#define CPUFREQ_GOV_START	1
+#define CPUFREQ_GOV_STOP	2
+#define CPUFREQ_GOV_LIMITS	3
+#define CPUFREQ_TABLE_END	~1
+
+struct cpufreq_frequency_table {
+	unsigned int index;
+	unsigned int frequency;
+};
+
+struct cpufreq_policy {
+	cpumask_t *cpus;
+	unsigned int cpu;
+	unsigned int min;
+	unsigned int max;
+	unsigned int cur;
+};
+
+struct cpufreq_governor {
+	char name[16];
+	int (*governor)(struct cpufreq_policy *policy, unsigned int event);
+	unsigned int max_transition_latency;
+	void *owner;
+};
+
+struct cpufreq_frequency_table *cpufreq_frequency_get_table(unsigned int cpu);
+int cpufreq_frequency_table_target(struct cpufreq_policy *policy,
+				   struct cpufreq_frequency_table *table,
+				   unsigned int target_freq,
+				   unsigned int relation, unsigned int *index);
+int __cpufreq_driver_target(struct cpufreq_policy *policy,
+			    unsigned int target_freq, unsigned int relation);
+#define cpufreq_register_governor(gov)		0
+#define cpufreq_unregister_governor(gov)	do { } while (0)
+
+/* input */
+#define INPUT_DEVICE_ID_MATCH_EVBIT	0x0008
+#define INPUT_DEVICE_ID_MATCH_KEYBIT	0x0010
+#define INPUT_DEVICE_ID_MATCH_ABSBIT	0x0040
+
+struct input_dev;
+struct input_handler;
+
+struct input_handle {
+	const char *name;
+	struct input_dev *dev;
+	struct input_handler *handler;
+};
+
+struct input_device_id {
+	unsigned long flags;
+	unsigned long evbit[BITS_TO_LONGS(EV_CNT)];
+	unsigned long keybit[BITS_TO_LONGS(KEY_CNT)];
+	unsigned long absbit[BITS_TO_LONGS(ABS_CNT)];
+};
+
+struct input_handler {
+	void (*event)(struct input_handle *handle, unsigned int type,
+		      unsigned int code, int value);
+	int (*connect)(struct input_handler *handler, struct input_dev *dev,
+		       const struct input_device_id *id);
+	void (*disconnect)(struct input_handle *handle);
+	const char *name;
+	const struct input_device_id *id_table;
+};
+
+#define input_register_handle(h)	0
+#define input_unregister_handle(h)	do { } while (0)
+#define input_open_device(h)		0
+#define input_close_device(h)		do { } while (0)
+#define input_register_handler(h)	0
+#define input_unregister_handler(h)	do { } while (0)
+
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_CPU_H
+#endif
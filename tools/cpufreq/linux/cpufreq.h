@@ -0,0 +1,2 @@
+#ifndef LINUX_CPUFREQ_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_CPUMASK_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_INPUT_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_KTHREAD_H
+#endif
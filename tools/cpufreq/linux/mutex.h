@@ -0,0 +1,2 @@
+#ifndef LINUX_MUTEX_H
+#endif
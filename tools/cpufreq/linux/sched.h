@@ -0,0 +1,2 @@
+#ifndef LINUX_SCHED_H
+#endif
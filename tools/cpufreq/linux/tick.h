@@ -0,0 +1,2 @@
+#ifndef LINUX_TICK_H
+#endif
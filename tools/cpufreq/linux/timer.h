@@ -0,0 +1,2 @@
+#ifndef LINUX_TIMER_H
+#endif
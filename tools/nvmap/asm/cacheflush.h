@@ -0,0 +1,2 @@
+#ifndef ASM_CACHEFLUSH_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef ASM_TLBFLUSH_H
+#endif
@@ -0,0 +1,363 @@
+/*
+ * heap_replay - replay carveout allocation traces against nvmap_heap.c
+ *
+ * Builds the kernel's carveout allocator in userspace and runs an
+ * allocation trace through nvmap_heap_alloc()/nvmap_heap_free(), reporting
+ * per-operation latency and how fragmented the free space gets.
+ *
+ * A trace is a text file with one operation per line:
+ *
+ *	a <id> <size> [<align>]		allocate size bytes as handle id
+ *	f <id>				free handle id
+ *
+ * Blank lines and lines starting with '#' are skipped.  With -n, a
+ * synthetic surface-churn workload is replayed instead.
+ */
+
+#define _GNU_SOURCE
+#include "nvmap_shim.h"
+#include "nvmap_heap.c"
+
+#include <getopt.h>
+#include <time.h>
+
+#define HEAP_BASE	0x10000000ULL
+#define MAX_IDS		(1 << 20)
+
+struct sample {
+	unsigned long long *ns;
+	size_t nr;
+	size_t cap;
+};
+
+static struct nvmap_handle **handles;
+static size_t nr_handles;
+
+static struct sample alloc_ns, free_ns;
+static unsigned long nr_failed, nr_failed_frag;
+static double frag_sum, frag_max;
+static unsigned long frag_samples;
+static unsigned long interval = 16;
+static unsigned long nr_ops;
+
+void v7_flush_kern_cache_all(void *info)
+{
+}
+
+void v7_clean_kern_cache_all(void *info)
+{
+}
+
+int nvmap_flush_heap_block(struct nvmap_client *client,
+			   struct nvmap_heap_block *block, size_t len,
+			   unsigned int prot)
+{
+	return 0;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sample_add(struct sample *s, unsigned long long ns)
+{
+	if (s->nr == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 4096;
+		s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+		if (!s->ns) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->ns[s->nr++] = ns;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void sample_report(const char *name, struct sample *s)
+{
+	unsigned long long sum = 0;
+	size_t i;
+
+	if (!s->nr) {
+		printf("%-6s ns: no samples\n", name);
+		return;
+	}
+	qsort(s->ns, s->nr, sizeof(*s->ns), cmp_ull);
+	for (i = 0; i < s->nr; i++)
+		sum += s->ns[i];
+	printf("%-6s ns: avg %llu p50 %llu p99 %llu max %llu\n", name,
+	       sum / s->nr, s->ns[s->nr / 2], s->ns[s->nr * 99 / 100],
+	       s->ns[s->nr - 1]);
+}
+
+/* 1 - largest free block / free space: 0 when all free space is in one
+ * block, close to 1 when it is scattered over many small ones */
+static double heap_frag(struct nvmap_heap *heap, struct heap_stat *stat)
+{
+	heap_stat(heap, stat);
+	if (!stat->free)
+		return 0;
+	return 1.0 - (double)stat->free_largest / stat->free;
+}
+
+static void sample_frag(struct nvmap_heap *heap)
+{
+	struct heap_stat stat;
+	double frag;
+
+	if (++nr_ops % interval)
+		return;
+	frag = heap_frag(heap, &stat);
+	frag_sum += frag;
+	frag_max = max(frag_max, frag);
+	frag_samples++;
+}
+
+static struct nvmap_handle *handle_of(unsigned long id)
+{
+	if (id >= MAX_IDS) {
+		fprintf(stderr, "handle id %lu too large\n", id);
+		exit(1);
+	}
+	if (id >= nr_handles) {
+		size_t nr = max(id + 1, 2 * nr_handles);
+
+		handles = realloc(handles, nr * sizeof(*handles));
+		if (!handles) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(handles + nr_handles, 0,
+		       (nr - nr_handles) * sizeof(*handles));
+		nr_handles = nr;
+	}
+	if (!handles[id]) {
+		handles[id] = calloc(1, sizeof(struct nvmap_handle));
+		if (!handles[id]) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+	return handles[id];
+}
+
+static bool do_alloc(struct nvmap_heap *heap, unsigned long id, size_t size,
+		     size_t align)
+{
+	struct nvmap_handle *h = handle_of(id);
+	struct nvmap_heap_block *b;
+	unsigned long long t;
+
+	if (h->carveout) {
+		fprintf(stderr, "handle %lu allocated twice\n", id);
+		return true;
+	}
+	h->size = size;
+	h->align = align;
+
+	t = now_ns();
+	b = nvmap_heap_alloc(heap, h);
+	sample_add(&alloc_ns, now_ns() - t);
+
+	if (!b) {
+		struct heap_stat stat;
+
+		heap_stat(heap, &stat);
+		nr_failed++;
+		if (stat.free >= size)
+			nr_failed_frag++;
+	}
+	h->alloc = !!b;
+	sample_frag(heap);
+	return b != NULL;
+}
+
+static void do_free(struct nvmap_heap *heap, unsigned long id)
+{
+	struct nvmap_handle *h = id < nr_handles ? handles[id] : NULL;
+	unsigned long long t;
+
+	if (!h || !h->carveout) {
+		fprintf(stderr, "handle %lu not allocated\n", id);
+		return;
+	}
+
+	t = now_ns();
+	nvmap_heap_free(h->carveout);
+	sample_add(&free_ns, now_ns() - t);
+
+	h->carveout = NULL;
+	h->alloc = false;
+	sample_frag(heap);
+}
+
+static int replay_trace(struct nvmap_heap *heap, FILE *f)
+{
+	char line[256];
+	unsigned int lineno = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long id, size, align = 0;
+		char op;
+		int n;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		n = sscanf(line, " %c %lu %lu %lu", &op, &id, &size, &align);
+		if (op == 'a' && n >= 3) {
+			do_alloc(heap, id, size, align ? align : PAGE_SIZE);
+		} else if (op == 'f' && n >= 2) {
+			do_free(heap, id);
+		} else {
+			fprintf(stderr, "line %u: bad operation\n", lineno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* surface sizes seen from SurfaceFlinger and video decode, in bytes */
+static const size_t surface_sizes[] = {
+	4096, 16384, 65536,			/* small buffers */
+	480 * 800 * 4,				/* WVGA RGBA */
+	1280 * 720 * 4,				/* 720p RGBA */
+	1280 * 736 * 3 / 2,			/* 720p NV12 decode */
+	1920 * 1088 * 3 / 2,			/* 1080p NV12 decode */
+	1920 * 1080 * 4,			/* 1080p RGBA */
+};
+
+#define NR_SURFACE_SIZES (sizeof(surface_sizes) / sizeof(surface_sizes[0]))
+
+/* keeps the heap around three quarters full, freeing a random surface
+ * whenever it gets fuller or an allocation fails */
+static void replay_synthetic(struct nvmap_heap *heap, size_t heap_size,
+			     unsigned long ops)
+{
+	unsigned long *live;
+	unsigned long nr_live = 0;
+	unsigned long next_id = 0;
+	size_t used = 0;
+
+	live = calloc(ops, sizeof(*live));
+	if (!live) {
+		perror("calloc");
+		exit(1);
+	}
+
+	while (ops--) {
+		if (nr_live && (used > heap_size / 4 * 3 || rand() % 2)) {
+			unsigned long i = rand() % nr_live;
+			unsigned long id = live[i];
+
+			used -= handles[id]->size;
+			do_free(heap, id);
+			live[i] = live[--nr_live];
+		} else {
+			size_t size = surface_sizes[rand() % NR_SURFACE_SIZES];
+			size_t align = size >= 65536 ? 65536 : PAGE_SIZE;
+
+			if (do_alloc(heap, next_id, size, align)) {
+				live[nr_live++] = next_id;
+				used += size;
+			}
+			next_id++;
+		}
+	}
+
+	while (nr_live)
+		do_free(heap, live[--nr_live]);
+	free(live);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s heap_size] [-b buddy_size] [-i interval]\n"
+		"       [-n ops [-S seed] | trace]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct nvmap_heap *heap;
+	struct heap_stat stat;
+	size_t heap_size = 64 << 20;
+	size_t buddy_size = 32768;
+	unsigned long ops = 0;
+	unsigned int seed = 1;
+	FILE *f = stdin;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:b:i:n:S:")) != -1) {
+		switch (opt) {
+		case 's':
+			heap_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			buddy_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			if (!interval)
+				interval = 1;
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nvmap_heap_init())
+		return 1;
+	heap = nvmap_heap_create(NULL, "replay", HEAP_BASE, heap_size,
+				 buddy_size, NULL);
+	if (!heap)
+		return 1;
+
+	if (ops) {
+		srand(seed);
+		replay_synthetic(heap, heap_size, ops);
+	} else {
+		if (optind < argc) {
+			f = fopen(argv[optind], "r");
+			if (!f) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
+		if (replay_trace(heap, f))
+			return 1;
+	}
+
+	printf("allocs: %zu (%lu failed, %lu of them with enough free space)\n",
+	       alloc_ns.nr, nr_failed, nr_failed_frag);
+	printf("frees:  %zu\n", free_ns.nr);
+	sample_report("alloc", &alloc_ns);
+	sample_report("free", &free_ns);
+	if (frag_samples)
+		printf("fragmentation: avg %.1f%% max %.1f%% "
+		       "(1 - largest free block / free space)\n",
+		       100 * frag_sum / frag_samples, 100 * frag_max);
+	heap_frag(heap, &stat);
+	printf("at exit: %zu bytes free in %zu blocks, largest %zu\n",
+	       stat.free, stat.free_count, stat.free_largest);
+	return 0;
+}
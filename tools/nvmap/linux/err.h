@@ -0,0 +1,2 @@
+#ifndef LINUX_ERR_H
+#endif
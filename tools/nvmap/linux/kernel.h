@@ -0,0 +1,2 @@
+#ifndef LINUX_KERNEL_H
+#endif
@@ -0,0 +1,2 @@
+#ifndef LINUX_LIST_H
+#endif
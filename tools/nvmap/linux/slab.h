@@ -0,0 +1,2 @@
+#ifndef LINUX_SLAB_H
+#endif
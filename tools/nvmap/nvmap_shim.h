@@ -0,0 +1,281 @@
+#ifndef NVMAP_SHIM_H
+#define NVMAP_SHIM_H
+
+/*
+ * Just enough of the kernel for drivers/video/tegra/nvmap/nvmap_heap.c to
+ * build and run as a single-threaded userspace program.  The carveout is
+ * never touched, so physical addresses are plain numbers here.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+
+typedef unsigned long long phys_addr_t;
+typedef struct { int counter; } atomic_t;
+
+#define __init
+#define GFP_KERNEL	0
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+#define PAGE_MASK	(~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(x)	ALIGN(x, PAGE_SIZE)
+#define L1_CACHE_BYTES	32
+#define BITS_PER_LONG	(8 * (int)sizeof(long))
+#define S_IRUGO		0444
+
+#define BUG_ON(cond)	assert(!(cond))
+#define WARN_ON(cond)	({ int __c = !!(cond); if (__c) fprintf(stderr, \
+			   "WARN_ON(%s) at %s:%d\n", #cond, __FILE__, \
+			   __LINE__); __c; })
+#define pr_err(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_err(dev, fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_warn(dev, fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_debug(dev, fmt, ...) do { } while (0)
+#define wmb()		__sync_synchronize()
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(x, y)	((x) < (y) ? (x) : (y))
+#define max(x, y)	((x) > (y) ? (x) : (y))
+#define max_t(type, x, y) max((type)(x), (type)(y))
+#define ALIGN(x, a)	(((x) + ((a) - 1)) & ~((typeof(x))(a) - 1))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define IS_ERR(ptr)	((unsigned long)(ptr) >= (unsigned long)-4095)
+
+static inline int atomic_read(const atomic_t *v)
+{
+	return v->counter;
+}
+
+/* bitops */
+static inline int fls(int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline unsigned long __fls(unsigned long word)
+{
+	return BITS_PER_LONG - 1 - __builtin_clzl(word);
+}
+
+static inline unsigned int fls_long(unsigned long l)
+{
+	return l ? __fls(l) + 1 : 0;
+}
+
+#define ilog2(n)	((int)__fls(n))
+
+static inline void __set_bit(int nr, unsigned long *addr)
+{
+	*addr |= 1UL << nr;
+}
+
+static inline void __clear_bit(int nr, unsigned long *addr)
+{
+	*addr &= ~(1UL << nr);
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr,
+					  unsigned long size,
+					  unsigned long offset)
+{
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+	word = *addr >> offset;
+	return word ? offset + __builtin_ctzl(word) : size;
+}
+
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = find_next_bit((addr), (size), 0); \
+	     (bit) < (size); \
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+/* lists */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline int list_is_last(const struct list_head *list,
+			       const struct list_head *head)
+{
+	return list->next == head;
+}
+
+static inline int list_is_singular(const struct list_head *head)
+{
+	return !list_empty(head) && (head->next == head->prev);
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, typeof(*pos), member); \
+	     &pos->member != (head); \
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+
+/* locking: the replay is single-threaded */
+struct mutex {
+	int locked;
+};
+
+#define mutex_init(m)	((m)->locked = 0)
+#define mutex_lock(m)	(assert(!(m)->locked), (m)->locked = 1)
+#define mutex_unlock(m)	(assert((m)->locked), (m)->locked = 0)
+
+/* allocation */
+struct kmem_cache {
+	size_t size;
+};
+
+#define KMEM_CACHE(s, flags) kmem_cache_create(sizeof(struct s))
+
+static inline struct kmem_cache *kmem_cache_create(size_t size)
+{
+	struct kmem_cache *c = malloc(sizeof(*c));
+
+	if (c)
+		c->size = size;
+	return c;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *c)
+{
+	free(c);
+}
+
+static inline void *kmem_cache_zalloc(struct kmem_cache *c, int gfp)
+{
+	return calloc(1, c->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	free(p);
+}
+
+static inline void *kzalloc(size_t size, int gfp)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+/* the heap's device and its sysfs attributes */
+struct attribute {
+	const char *name;
+	mode_t mode;
+};
+
+struct attribute_group {
+	struct attribute **attrs;
+};
+
+struct kobject {
+	int dummy;
+};
+
+struct device {
+	struct device *parent;
+	void *driver;
+	struct kobject kobj;
+	void (*release)(struct device *dev);
+	char name[32];
+};
+
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr,
+			char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count);
+};
+
+#define __ATTR(_name, _mode, _show, _store) { \
+	.attr = { .name = #_name, .mode = _mode }, \
+	.show = _show, \
+	.store = _store, \
+}
+
+#define dev_set_name(dev, fmt, ...) \
+	snprintf((dev)->name, sizeof((dev)->name), fmt, ##__VA_ARGS__)
+#define dev_name(dev)		((dev)->name)
+#define device_register(dev)	0
+#define device_unregister(dev)	do { } while (0)
+#define sysfs_create_group(kobj, grp)	0
+#define sysfs_remove_group(kobj, grp)	do { } while (0)
+
+/* cache maintenance, see nvmap_common.h */
+struct page;
+struct address_space;
+
+#define on_each_cpu(func, info, wait)	func(info)
+static inline void outer_flush_range(phys_addr_t start, phys_addr_t end) { }
+
+/* the parts of nvmap.h used by the heap, which is not included itself */
+#define __VIDEO_TEGRA_NVMAP_NVMAP_H
+
+struct nvmap_client;
+struct nvmap_device;
+
+struct nvmap_handle {
+	size_t size;
+	size_t align;
+	unsigned int flags;
+	bool alloc;
+	bool heap_pgalloc;
+	int usecount;
+	struct mutex lock;
+	struct nvmap_heap_block *carveout;
+};
+
+#endif